@@ -0,0 +1,134 @@
+/*
+ * asm.c - assembler and disassembler for sketch programs
+ *
+ * The text form has one instruction per line, with # starting a comment:
+ *
+ *     dx 30       Change x position.
+ *     dy -5       Change y position, drawing a line if the pen is down.
+ *     dt 63       Pause for the given number of hundredths of a second.
+ *     pen         Toggle the pen.
+ *     clear       Clear the display.
+ *     key         Wait for a key press.
+ *     hue 0x00ff00ff   Change the drawing colour to the given rgba value.
+ *     loop 15     Run the instructions up to the matching next 15 times.
+ *     next        End the innermost loop.
+ *
+ * The disassembler indents the instructions inside each loop.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "program.h"
+
+// Declare function signatures.
+bool assemble(FILE * in, FILE * out);
+bool disassemble(FILE * in, FILE * out);
+bool parse(char * text, instruction * i);
+
+int main(int argc, char * argv[]) {
+    bool reverse = argc == 4 && strcmp(argv[1], "-d") == 0;
+    if (argc != 3 && !reverse) {
+        fprintf(stderr, "Usage: ./sketch-asm [in.txt] [out.sketch]\n"
+                        "       ./sketch-asm -d [in.sketch] [out.txt]\n");
+        return 1;
+    }
+
+    // Open the files, with - meaning stdin or stdout.
+    char * from = argv[argc - 2], * to = argv[argc - 1];
+    FILE * in = strcmp(from, "-") == 0 ? stdin : fopen(from, "rb");
+    FILE * out = strcmp(to, "-") == 0 ? stdout : fopen(to, "wb");
+    if (!in || !out) {
+        fprintf(stderr, "error: %s: %s\n", !in ? from : to, strerror(errno));
+        return 1;
+    }
+
+    bool ok = reverse ? disassemble(in, out) : assemble(in, out);
+    fclose(in);
+    if (fclose(out) != 0) ok = false;
+    return ok ? 0 : 1;
+}
+
+// Translate text into bytecode, using the shortest encoding of each
+// instruction.
+bool assemble(FILE * in, FILE * out) {
+    char * line = NULL; size_t size = 0;
+    unsigned char bytes[5];
+    bool ok = true;
+    for (int n = 1; getline(&line, &size, in) > 0; n++) {
+        // Ignore comments and blank lines.
+        char * comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        char * text = line;
+        while (isspace((unsigned char) *text)) text++;
+        if (*text == '\0') continue;
+
+        instruction i;
+        if (!parse(text, &i)) {
+            fprintf(stderr, "error: line %d: can't understand %s", n, text);
+            if (text[strlen(text) - 1] != '\n') fprintf(stderr, "\n");
+            ok = false;
+            continue;
+        }
+        fwrite(bytes, 1, encode(i, bytes), out);
+    }
+    free(line);
+    return ok;
+}
+
+// Parse one instruction, such as "dx -5" or "pen".
+bool parse(char * text, instruction * i) {
+    char name[8], rest[2]; long long operand = 0;
+    int n = sscanf(text, "%7s %lli %1s", name, &operand, rest);
+    for (int opcode = DX; opcode <= NX; opcode++) {
+        if (strcmp(name, mnemonics[opcode]) != 0) continue;
+
+        // Moves, pauses, colours and loops need an operand, and colours are
+        // unsigned.
+        bool needs = opcode <= DT || opcode == HU || opcode == LP;
+        if (n != (needs ? 2 : 1)) return false;
+        long long low = opcode == HU ? 0 : INT32_MIN;
+        long long high = opcode == HU ? UINT32_MAX : INT32_MAX;
+        if (operand < low || operand > high) return false;
+
+        *i = (instruction) { opcode, (int32_t) (uint32_t) operand };
+        return true;
+    }
+    return false;
+}
+
+// Translate bytecode into text, one instruction per line.
+bool disassemble(FILE * in, FILE * out) {
+    unsigned char bytes[5]; int depth = 0;
+    int byte; while ((byte = getc(in)) != EOF) {
+        bytes[0] = (unsigned char) byte;
+        int n = width(byte);
+        if (fread(bytes + 1, 1, n - 1, in) != (size_t) n - 1) {
+            fprintf(stderr, "error: truncated instruction\n");
+            return false;
+        }
+
+        instruction i;
+        if (decode(bytes, bytes + n, &i) < 0) {
+            fprintf(stderr, "error: unknown opcode\n");
+            return false;
+        }
+        const char * name = mnemonics[i.opcode];
+        if (i.opcode == NX && depth > 0) depth--;
+        fprintf(out, "%*s", 4 * depth, "");
+        if (i.opcode == LP) depth++;
+        if (i.opcode == HU) {
+            fprintf(out, "%s 0x%08x\n", name, (uint32_t) i.operand);
+        } else if (i.opcode <= DT || i.opcode == LP) {
+            fprintf(out, "%s %d\n", name, i.operand);
+        } else {
+            fprintf(out, "%s\n", name);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,154 @@
+/*
+ * backend.c - run-time choice of display backend
+ */
+
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "backend.h"
+
+// The backend used when none is chosen, which can be set when building.
+#ifndef BACKEND
+#ifdef SDL
+#define BACKEND "sdl"
+#else
+#define BACKEND "framebuffer"
+#endif
+#endif
+
+// The backends which are built in, in the order they are listed.
+static const backend * const backends[] = {
+#ifdef SDL
+    &sdlBackend,
+#endif
+    &framebufferBackend, &nullBackend, &traceBackend, &testBackend,
+    &videoBackend
+};
+enum { BACKENDS = sizeof(backends) / sizeof(backends[0]) };
+
+// The backend chosen, if any, and whether to draw on a render thread.
+static const backend * chosen = NULL;
+static bool threaded = false;
+
+// The scripted keys, if any, and the virtual times at which they are pressed.
+static int scripted = 0;
+static long * times = NULL;
+static char * keys = NULL;
+
+bool useBackend(char * name) {
+    for (int i = 0; i < BACKENDS; i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            chosen = backends[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+char * backendName(int i) {
+    return i >= 0 && i < BACKENDS ? backends[i]->name : NULL;
+}
+
+char * chosenBackend() {
+    if (chosen == NULL && !useBackend(BACKEND)) chosen = backends[0];
+    return chosen->name;
+}
+
+void useRenderThread(bool on) {
+    threaded = on;
+}
+
+void typeKeys(int n, long * at, char * typed) {
+    scripted = n;
+    times = at;
+    keys = typed;
+}
+
+display * openBackend(const backend * b, char * title, int width, int height) {
+    display * d = b->open(title, width, height);
+    *d = (display) { .backend = b, .speed = 1 };
+    return d;
+}
+
+void callHook(display * d) {
+    if (d->hook != NULL) d->hook(d, d->clock, d->arg);
+}
+
+/*
+ * The display functions, which pass each call on to the display's backend.
+ *****************************************************/
+
+display * newDisplay(char * title, int width, int height) {
+    chosenBackend();
+    if (threaded) return openRenderer(chosen, title, width, height);
+    return openBackend(chosen, title, width, height);
+}
+
+void line(display * d, int x0, int y0, int x1, int y1) {
+    d->backend->line(d, x0, y0, x1, y1);
+}
+
+void colour(display * d, int rgba) {
+    d->backend->colour(d, rgba);
+}
+
+void pause(display * d, int ms) {
+    d->backend->pause(d, ms);
+    d->clock += ms;
+}
+
+void skip(display * d, long ms, int keys) {
+    if (d->backend->skip != NULL) d->backend->skip(d, ms);
+    d->clock += ms;
+    d->typed += keys;
+}
+
+void clear(display * d) {
+    d->backend->clear(d);
+}
+
+void show(display * d) {
+    d->backend->show(d);
+}
+
+// Take a scripted key, if there is one left, as a pause until it is pressed,
+// so that the picture is shown and held for that long.
+char key(display * d) {
+    if (d->typed >= scripted) return d->backend->key(d);
+    int i = d->typed++;
+    long wait = times[i] - d->clock;
+    if (wait < 0) wait = 0;
+    if (wait > INT_MAX) wait = INT_MAX;
+    pause(d, wait);
+    return keys[i];
+}
+
+bool end(display * d) {
+    return d->backend->end(d);
+}
+
+void discard(display * d) {
+    d->backend->discard(d);
+}
+
+void speed(display * d, double factor) {
+    d->speed = factor;
+}
+
+void onFrame(display * d, frameHook * hook, void * arg) {
+    d->hook = hook;
+    d->arg = arg;
+}
+
+bool snapshot(display * d, char * path) {
+    if (d->backend->snapshot == NULL) return false;
+    return d->backend->snapshot(d, path);
+}
+
+bool digest(display * d, uint64_t * out) {
+    if (d->backend->digest == NULL) return false;
+    return d->backend->digest(d, out);
+}
+
+/*****************************************************/
@@ -0,0 +1,58 @@
+/* The backend module lets the display be chosen at run time, rather than when
+the program is linked.  Each backend, such as the SDL window or the headless
+framebuffer, provides its own version of each display function, and the
+functions in display.h pass each call on to the backend of the display it is
+for.  The fields which all displays share, the virtual clock, the playback
+speed and the frame hook, are kept in one place, here.
+*/
+#include "display.h"
+
+// The fields which every display starts with.  A backend's own display
+// structure has one of these as its first field.
+struct display {
+    const struct backend *backend;
+    long clock;      // Virtual time, in milliseconds.
+    double speed;    // Playback speed, scaling real delays.
+    frameHook *hook;
+    void *arg;
+    int typed;       // Number of scripted keys used so far.
+};
+
+// A backend is a name and a table of display functions.  The virtual clock is
+// advanced after the backend's pause or skip function returns, and the skip
+// function is NULL if the backend has nothing to do but that.  A backend which
+// fails part way, such as a trace which doesn't match, reports it and carries
+// on, and its end function returns false.  The snapshot and digest functions
+// are NULL if the backend has no picture.
+struct backend {
+    char *name;
+    display *(*open)(char *title, int width, int height);
+    void (*line)(display *d, int x0, int y0, int x1, int y1);
+    void (*colour)(display *d, int rgba);
+    void (*pause)(display *d, int ms);
+    void (*skip)(display *d, long ms);
+    void (*clear)(display *d);
+    void (*show)(display *d);
+    char (*key)(display *d);
+    bool (*end)(display *d);
+    void (*discard)(display *d);
+    bool (*snapshot)(display *d, char *path);
+    bool (*digest)(display *d, uint64_t *out);
+};
+typedef struct backend backend;
+
+// The backends.  The SDL backend is only built in when SDL is defined.
+extern const backend sdlBackend, framebufferBackend, nullBackend;
+extern const backend traceBackend, testBackend, videoBackend;
+
+// Open a display with the given backend, on the calling thread.
+display *openBackend(const backend *b, char *title, int width, int height);
+
+// Open a display with the given backend on a render thread of its own, and
+// return a display which queues drawing calls and pauses for that thread
+// without waiting.  Key waits and the end wait until the drawing before them is
+// done.
+display *openRenderer(const backend *b, char *title, int width, int height);
+
+// Call the display's frame hook, if it has one.
+void callHook(display *d);
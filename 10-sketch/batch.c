@@ -0,0 +1,69 @@
+/*
+ * batch.c - parallel processing of many files
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+// Define the structure shared by the workers in a batch.
+struct batch {
+    pthread_mutex_t lock; // Protects next and ok.
+    job * work;
+    char ** paths;
+    int n;
+    int next; // Index of the next unclaimed path.
+    bool ok;  // Have all jobs so far succeeded?
+};
+typedef struct batch batch;
+
+// Declare function signatures.
+static void * worker(void * arg);
+
+int cores() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+bool runBatch(job * work, char ** paths, int n, int threads) {
+    batch b = { .work = work, .paths = paths, .n = n, .next = 0, .ok = true };
+    pthread_mutex_init(&b.lock, NULL);
+
+    // There is no point in having more workers than files.
+    if (threads > n) threads = n;
+    if (threads < 1) threads = 1;
+    pthread_t pool[threads];
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool[i], NULL, worker, &b) != 0) {
+            fprintf(stderr, "error: can't create worker thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) pthread_join(pool[i], NULL);
+
+    pthread_mutex_destroy(&b.lock);
+    return b.ok;
+}
+
+// Claim and process files until there are none left.
+static void * worker(void * arg) {
+    batch * b = arg;
+    while (true) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next < b->n ? b->next++ : -1;
+        pthread_mutex_unlock(&b->lock);
+        if (i < 0) return NULL;
+
+        bool ok = b->work(b->paths[i]);
+        if (!ok) {
+            pthread_mutex_lock(&b->lock);
+            b->ok = false;
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+}
@@ -0,0 +1,15 @@
+/* The batch module runs a job for each of a list of files on a fixed-size pool
+of worker threads.  Workers take the next unclaimed file whenever they finish
+one, so long files don't hold up the rest of the batch.
+*/
+#include <stdbool.h>
+
+// A job processes one file, returning false if it failed.
+typedef bool job(char *path);
+
+// Find the number of processors available, for the default pool size.
+int cores();
+
+// Run the job for each of the n paths, using the given number of threads.
+// Return true if every job succeeded.
+bool runBatch(job *work, char **paths, int n, int threads);
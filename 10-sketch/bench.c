@@ -0,0 +1,495 @@
+/*
+ * bench.c - decoder and dispatch microbenchmarks for the sketch interpreter
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "canvas.h"
+#include "program.h"
+
+// Define a structure for the state that the benchmark handlers update, so
+// that the compiler can't optimise the work away.
+struct sink { long cx, cy, ticks, calls, depth; bool PD; uint32_t rgba; };
+typedef struct sink sink;
+
+// Define a structure for an opcode mix: the relative weight of each opcode,
+// and the percentage of moves and pauses which use the extension forms.
+struct mix { int weights[NX + 1]; int total; int wide; };
+typedef struct mix mix;
+
+// Define global objects.
+sink K;
+
+// The interpreter which is built with the null display, and the optimizer.
+const char * INTERPRETER = "./sketch-null";
+const char * OPTIMIZER = "./sketch-opt";
+
+// Declare function signatures.
+void decoders(size_t size);
+void rasterizer(int lines);
+void generator(size_t size, char * spec);
+void throughput(char * path);
+void fuzz(int rounds);
+void fuzzLoops(int rounds, const char * path, uint64_t * seed,
+               long * failures);
+unsigned char * generate(size_t size, uint64_t seed);
+bool parse_mix(char * spec, mix * m);
+int random_instruction(mix * m, uint64_t * seed, unsigned char bytes[5]);
+uint64_t next(uint64_t * seed);
+int run(const char * tool, const char * format, const char * path);
+long ladder(const unsigned char * p, const unsigned char * end);
+long table(const unsigned char * p, const unsigned char * end);
+double seconds();
+void dx(int operand); void dy(int operand); void dt(int operand);
+void pn(int operand); void cl(int operand); void ky(int operand);
+void hu(int operand); void lp(int operand); void nx(int operand);
+
+// Define the handler for each opcode.
+void (* const handlers[])(int operand) = { dx, dy, dt, pn, cl, ky, hu, lp, nx };
+
+int main(int argc, char * argv[]) {
+    char * mode = argc > 1 ? argv[1] : "";
+    long size = argc > 2 ? atol(argv[2]) : 0;
+    if (strcmp(mode, "decode") == 0) {
+        decoders(size > 0 ? size : 64);
+    } else if (strcmp(mode, "raster") == 0) {
+        rasterizer(size > 0 ? size : 1000000);
+    } else if (strcmp(mode, "generate") == 0) {
+        generator(size > 0 ? size : 256, argc > 3 ? argv[3] : "");
+    } else if (strcmp(mode, "throughput") == 0 && argc > 2) {
+        throughput(argv[2]);
+    } else if (strcmp(mode, "fuzz") == 0) {
+        fuzz(size > 0 ? size : 10000);
+    } else {
+        fprintf(stderr, "Usage: ./bench decode [megabytes]\n"
+                        "       ./bench raster [lines]\n"
+                        "       ./bench generate [megabytes] [mix] > file\n"
+                        "       ./bench throughput [file]\n"
+                        "       ./bench fuzz [rounds]\n"
+                        "A mix is like dx=40,dy=40,dt=5,pen=5,hue=2,wide=20\n");
+        return 1;
+    }
+}
+
+// Time each decoder over the same random program of the given size in MB,
+// keeping the best of 3 runs.
+void decoders(size_t size) {
+    size <<= 20;
+    unsigned char * program = generate(size, 0x5eed);
+    const char * names[] = { "if/else ladder", "decoding table" };
+    long (* runs[])(const unsigned char *, const unsigned char *) = {
+        ladder, table
+    };
+
+    printf("%zu MB random program\n", size >> 20);
+    for (int r = 0; r < 2; r++) {
+        double best = 1e9; long count = 0;
+        for (int k = 0; k < 3; k++) {
+            memset(&K, 0, sizeof(K));
+            double start = seconds();
+            count = runs[r](program, program + size);
+            double taken = seconds() - start;
+            if (taken < best) best = taken;
+        }
+        printf("%-16s %10ld instructions %8.1f M instructions/s (%ld)\n",
+               names[r], count, count / best / 1e6, K.cx + K.cy + K.ticks);
+    }
+    free(program);
+}
+
+// Time drawing horizontal, vertical and diagonal lines of random lengths on a
+// 200x200 canvas, reporting the cost per line and per pixel.
+void rasterizer(int lines) {
+    const char * names[] = { "horizontal", "vertical", "diagonal" };
+    canvas * c = newCanvas(200, 200, 0xFFFFFFFF);
+
+    printf("%d lines of each kind\n", lines);
+    for (int kind = 0; kind < 3; kind++) {
+        uint64_t seed = 0x5eed; long pixels = 0;
+        double start = seconds();
+        for (int i = 0; i < lines; i++) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            int x = seed % 200, y = (seed >> 8) % 200;
+            int n = (seed >> 16) % (200 - (x > y ? x : y));
+            int dx = kind == 1 ? 0 : n, dy = kind == 0 ? 0 : n;
+            drawLine(c, x, y, x + dx, y + dy, (uint32_t) seed | 0xFF);
+            pixels += n + 1;
+        }
+        double taken = seconds() - start;
+        printf("%-10s %8.1f ns/line %6.2f ns/pixel\n", names[kind],
+               taken / lines * 1e9, taken / pixels * 1e9);
+    }
+    freeCanvas(c);
+}
+
+// Write a random valid program of the given size in MB to stdout, with the
+// given opcode mix, a megabyte at a time so that memory use stays constant.
+void generator(size_t size, char * spec) {
+    mix m;
+    if (!parse_mix(spec, &m)) {
+        fprintf(stderr, "error: bad mix %s\n", spec);
+        exit(1);
+    }
+    uint64_t seed = 0x5eed;
+    unsigned char * block = malloc((1 << 20) + 5);
+    for (size_t done = 0; done < size; done++) {
+        int n = 0;
+        while (n < 1 << 20) n += random_instruction(&m, &seed, block + n);
+        fwrite(block, 1, n, stdout);
+    }
+    free(block);
+}
+
+// Time the interpreter running a program with the null display, and report
+// its speed.  Instructions are counted separately, outside the timing.
+void throughput(char * path) {
+    FILE * in = fopen(path, "rb");
+    if (!in) { perror(path); exit(1); }
+    unsigned char * block = malloc(1 << 20);
+    long count = 0, bytes = 0, skip = 0; size_t got;
+    while ((got = fread(block, 1, 1 << 20, in)) > 0) {
+        for (size_t i = 0; i < got; i++) {
+            if (skip > 0) { skip--; continue; }
+            count++; skip = width(block[i]) - 1;
+        }
+        bytes += got;
+    }
+    fclose(in); free(block);
+
+    double start = seconds();
+    int status = run(INTERPRETER, "%s %s", path);
+    double taken = seconds() - start;
+    if (status != 0) {
+        fprintf(stderr, "error: interpreter failed on %s\n", path);
+        exit(1);
+    }
+    printf("%ld instructions, %ld bytes in %.2f s\n", count, bytes, taken);
+    printf("%.1f M instructions/s, %.1f MB/s\n",
+           count / taken / 1e6, bytes / taken / (1 << 20));
+}
+
+// Check that truncated and corrupted programs are rejected cleanly.  Each
+// round generates a short program and cuts it at every possible point,
+// checking that the decoder never reads past the end, and reports exactly the
+// cuts which fall inside an instruction as truncated.  Random bytes are then
+// decoded as well, and finally the interpreter is run on truncated files,
+// both mapped and piped, and must fail rather than read EOF as operands.  Last,
+// it is run on random repeat blocks, and must fail exactly when they don't
+// match.
+void fuzz(int rounds) {
+    mix m;
+    parse_mix("dx=1,dy=1,dt=1,pen=1,clear=1,key=1,hue=1,loop=1,next=1,wide=50",
+              &m);
+    uint64_t seed = 0xf022;
+    unsigned char program[64 * 5], bytes[5];
+    long failures = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        // Generate a program, noting where each instruction starts.
+        int length = 0, count = 1 + next(&seed) % 64;
+        bool start[64 * 5 + 1] = { false };
+        for (int k = 0; k < count; k++) {
+            start[length] = true;
+            int n = random_instruction(&m, &seed, bytes);
+            memcpy(program + length, bytes, n); length += n;
+        }
+        start[length] = true;
+
+        // Decode each prefix from an exactly-sized copy.
+        for (int cut = 0; cut <= length; cut++) {
+            unsigned char * copy = malloc(cut > 0 ? cut : 1);
+            memcpy(copy, program, cut);
+            const unsigned char * p = copy, * end = copy + cut;
+            int used = 1; instruction i;
+            while (p < end && (used = decode(p, end, &i)) > 0) p += used;
+            bool truncated = p < end && used == 0;
+            if (used < 0 || p > end || truncated == start[cut]) failures++;
+            free(copy);
+        }
+
+        // Decode random bytes, which may contain unknown opcodes.
+        for (int k = 0; k < length; k++) {
+            program[k] = (unsigned char) next(&seed);
+        }
+        const unsigned char * p = program, * end = program + length;
+        int used; instruction i;
+        while (p < end && (used = decode(p, end, &i)) != 0) {
+            if (used < 0) used = 1;
+            if (p + used > end) { failures++; break; }
+            p += used;
+        }
+    }
+
+    // Cut a valid program inside each width of extension operand, and then
+    // end one with an unknown opcode instead, and check that the interpreter
+    // and the optimizer reject it, rather than crash.
+    const char * path = "fuzz.sketch";
+    for (int n = 1; n <= 4; n++) {
+        FILE * out = fopen(path, "wb");
+        fwrite("\x1e\x5e\xc3", 1, 3, out);
+        if (n < 4) {
+            putc(PN << 6 | n << 4 | DX, out);
+            fwrite("\x01\x02\x03", 1, n == 3 ? 3 : n - 1, out);
+        } else putc(PN << 6 | 0xF, out);
+        fclose(out);
+        if (run(INTERPRETER, "%s %s 2> /dev/null", path) == 0) failures++;
+        if (run(INTERPRETER, "cat %2$s | %1$s - 2> /dev/null", path) == 0) {
+            failures++;
+        }
+        if (run(OPTIMIZER, "%s %s fuzz.out > /dev/null 2>&1", path) != 1) {
+            failures++;
+        }
+    }
+    fuzzLoops(rounds / 100 + 1, path, &seed, &failures);
+    remove(path); remove("fuzz.out");
+
+    printf("%d rounds, %ld failures\n", rounds, failures);
+    if (failures > 0) exit(1);
+}
+
+// Write random nests of repeat blocks, a few not closed or closed twice, and
+// check that the interpreter fails exactly on those, whether the program is
+// mapped, piped or compiled.  Blocks repeat at most 3 times and are at most 4
+// deep, and some repeat 0 times, so that they are skipped.
+void fuzzLoops(int rounds, const char * path, uint64_t * seed,
+               long * failures) {
+    char sidecar[strlen(path) + 2];
+    sprintf(sidecar, "%sc", path);
+    for (int r = 0; r < rounds; r++) {
+        FILE * out = fopen(path, "wb");
+        int depth = 0; bool matched = true;
+        unsigned char bytes[5];
+        for (int k = 0; k < 24; k++) {
+            uint64_t x = next(seed);
+            int operand = (x >> 8) % 8;
+            instruction i = { DY, operand };
+            if (x % 3 == 0 && depth < 4) i = (instruction) { LP, operand % 4 };
+            else if (x % 3 == 1 && (depth > 0 || x % 5 == 0)) {
+                i = (instruction) { NX, 0 };
+            }
+            if (i.opcode == LP) depth++;
+            else if (i.opcode == NX && depth == 0) matched = false;
+            else if (i.opcode == NX) depth--;
+            fwrite(bytes, 1, encode(i, bytes), out);
+        }
+        for (; depth > 0 && next(seed) % 8 != 0; depth--) {
+            fwrite(bytes, 1, encode((instruction) { NX, 0 }, bytes), out);
+        }
+        fclose(out);
+        if (depth > 0) matched = false;
+
+        const char * formats[] = {
+            "%s %s 2> /dev/null", "cat %2$s | %1$s - 2> /dev/null",
+            "%s --cache %s 2> /dev/null"
+        };
+        for (int f = 0; f < 3; f++) {
+            if ((run(INTERPRETER, formats[f], path) == 0) != matched) {
+                (*failures)++;
+            }
+        }
+        remove(sidecar);
+    }
+}
+
+// Generate a random valid program of the given size.  Like real sketches, it
+// is a walk of strokes (DX then DY) with occasional pauses, pen toggles and
+// colour changes, but the operands and their encoded widths are random.
+unsigned char * generate(size_t size, uint64_t seed) {
+    unsigned char * program = malloc(size);
+    size_t i = 0; long strokes = 0;
+    while (i + 12 <= size) {
+        for (int opcode = DX; opcode <= DY; opcode++) {
+            // Use xorshift to produce pseudo-random numbers.
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            int n = (seed & 0xF) < 13 ? 0 : (int) ((seed >> 4) % 3) + 1;
+            if (n == 0) {
+                int operand = (seed >> 8) & 0x3F;
+                program[i++] = (unsigned char) (opcode << 6 | operand);
+                continue;
+            }
+            program[i++] = (unsigned char) (PN << 6 | n << 4 | opcode);
+            for (int j = 0; j < (n == 3 ? 4 : n); j++) {
+                program[i++] = (unsigned char) (seed >> (16 + 8 * j));
+            }
+        }
+        strokes++;
+        if (strokes % 8 == 0) program[i++] = (unsigned char) (DT << 6 | 5);
+        if (strokes % 32 == 0) program[i++] = (unsigned char) (PN << 6 | PN);
+        if (strokes % 256 == 0) {
+            program[i++] = (unsigned char) (PN << 6 | 1 << 4 | HU);
+            program[i++] = (unsigned char) (seed >> 56);
+        }
+    }
+
+    // Pad the end with zero-length moves.
+    while (i < size) program[i++] = (unsigned char) (DX << 6);
+    return program;
+}
+
+// Parse a mix such as "dx=40,dy=40,wide=20".  Opcodes which aren't mentioned
+// get a weight of 0, and an empty mix is a default mix of strokes.
+bool parse_mix(char * spec, mix * m) {
+    if (*spec == '\0') spec = "dx=40,dy=40,dt=5,pen=5,hue=2,wide=20";
+    *m = (mix) { .total = 0, .wide = 0 };
+    char * copy = strdup(spec);
+    for (char * item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char * equals = strchr(item, '=');
+        if (equals == NULL) { free(copy); return false; }
+        *equals = '\0';
+        int weight = atoi(equals + 1), opcode = DX;
+        while (opcode <= NX && strcmp(item, mnemonics[opcode]) != 0) opcode++;
+        if (strcmp(item, "wide") == 0) m->wide = weight;
+        else if (opcode <= NX) m->weights[opcode] = weight;
+        else { free(copy); return false; }
+    }
+    free(copy);
+    for (int opcode = DX; opcode <= NX; opcode++) {
+        m->total += m->weights[opcode];
+    }
+    return m->total > 0;
+}
+
+// Encode a random instruction drawn from a mix, returning its length.  Wide
+// forms use 1, 2 or 4 operand bytes at random, rather than the shortest.
+// Repeat blocks aren't matched up, and repeat from 0 to 3 times.
+int random_instruction(mix * m, uint64_t * seed, unsigned char bytes[5]) {
+    uint64_t r = next(seed);
+    int pick = r % m->total, opcode = DX;
+    while (pick >= m->weights[opcode]) pick -= m->weights[opcode++];
+
+    r >>= 16;
+    bool wide = opcode == HU || (opcode <= DT && (int) (r % 100) < m->wide);
+    if (opcode <= DT && !wide) {
+        bytes[0] = (unsigned char) (opcode << 6 | ((r >> 8) & 0x3F));
+        return 1;
+    }
+    int code = opcode <= DT || opcode >= HU ? (r >> 8) % 4 : 0;
+    if (opcode <= DT && code == 0) code = 1;
+    if (opcode == NX) code = 0;
+    int n = code == 3 ? 4 : code;
+    bytes[0] = (unsigned char) (PN << 6 | code << 4 | opcode);
+    for (int j = 0; j < n; j++) {
+        bytes[1 + j] = (unsigned char) (r >> (16 + 8 * j));
+        if (opcode == LP) bytes[1 + j] = j == n - 1 ? (r >> 16) % 4 : 0;
+    }
+    return 1 + n;
+}
+
+// Use xorshift to produce pseudo-random numbers.
+uint64_t next(uint64_t * seed) {
+    *seed ^= *seed << 13; *seed ^= *seed >> 7; *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Run a tool on a file, with a shell command made from a format which takes
+// the tool and the path, and return its exit status, or -1 if it crashed.
+int run(const char * tool, const char * format, const char * path) {
+    char command[strlen(format) + strlen(tool) + strlen(path) + 1];
+    sprintf(command, format, tool, path);
+    int status = system(command);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Decode and dispatch the way sketch.c originally did: split each byte, then
+// walk nested if/else ladders on the opcode and extended opcode.
+long ladder(const unsigned char * p, const unsigned char * end) {
+    long count = 0;
+    while (p < end) {
+        int byte = *p++;
+        int opcode = byte >> 6;
+        int operand = byte & ~(0x3 << 6);
+        count++;
+
+        if (opcode == PN) {
+            opcode = operand & ~(0xF << 4);
+            unsigned char b[4] = {0};
+            int n = (operand >> 4) & 0x3;
+            if (n == 3) { n = 4; }
+            for (int i = 0; i < n; i++) b[i] = *p++;
+            uint32_t u = 0;
+            if (n == 1) operand = b[0];
+            else if (n == 2) {
+                u = (uint32_t) b[0] << 8 | b[1];
+                if (u >> 15 == 1) u = ~u ^ 0xFFFF;
+                operand = (int) u;
+            } else if (n == 4) {
+                u = (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 |
+                    (uint32_t) b[2] << 8 | b[3];
+                if (u >> 31 == 1) u = ~u ^ 0xFFFFFFFF;
+                operand = (int) u;
+            } else operand = 0;
+
+            if (opcode == DX) dx(operand);
+            else if (opcode == DY) dy(operand);
+            else if (opcode == DT) dt(operand);
+            else if (opcode == PN) pn(operand);
+            else if (opcode == CL) cl(operand);
+            else if (opcode == KY) ky(operand);
+            else if (opcode == HU) hu(operand);
+            else if (opcode == LP) lp(operand);
+            else if (opcode == NX) nx(operand);
+            else return -1;
+        } else if (opcode == DX) {
+            if (operand >> 5 == 1) dx((int)(~operand ^ 0x3F));
+            else dx(operand);
+        } else if (opcode == DY) {
+            if (operand >> 5 == 1) dy((int)(~operand ^ 0x3F));
+            else dy(operand);
+        } else if (opcode == DT) {
+            dt(operand);
+        } else {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Decode and dispatch the way sketch.c does now: look each byte up in the
+// decoding table, and call through the handler table.
+long table(const unsigned char * p, const unsigned char * end) {
+    long count = 0;
+    while (p < end) {
+        const entry * e = &decoding[*p];
+        count++;
+        if (e->extra == 0 && e->opcode >= 0) {
+            handlers[e->opcode](e->operand); p++;
+            continue;
+        }
+        instruction i;
+        int used = decode(p, end, &i);
+        if (used <= 0) return -1;
+        handlers[i.opcode](i.operand); p += used;
+    }
+    return count;
+}
+
+// Read a monotonic clock in seconds.
+double seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * Handlers which mimic the interpreter's state changes without drawing.
+ *****************************************************/
+
+void dx(int operand) { K.cx += operand; }
+void dy(int operand) { K.cy += operand; if (K.PD) K.calls++; }
+void dt(int operand) { K.ticks += operand; }
+void pn(int operand) { K.PD = !K.PD; }
+void cl(int operand) { K.calls++; }
+void ky(int operand) { K.calls++; }
+void hu(int operand) { K.rgba = (uint32_t) operand; }
+void lp(int operand) { K.depth++; }
+void nx(int operand) { K.depth--; }
+
+/*****************************************************/
@@ -0,0 +1,500 @@
+/*
+ * canvas.c - in-memory RGBA pictures
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canvas.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The width and height of a tile, in pixels, which is a power of two.
+enum { SHIFT = 6, TILE = 1 << SHIFT };
+
+// A tile is a square of pixels, whose top left corner is at (TILE*tx, TILE*ty).
+struct tile {
+    int tx, ty;
+    uint32_t pixels[TILE * TILE]; // Rows of pixels, from top to bottom.
+};
+typedef struct tile tile;
+
+// Define the structure of a canvas instance.  A canvas bounded in both
+// directions, and no bigger than FLAT pixels, is a flat array of pixels, which
+// is the quickest to draw on.  Otherwise, tiles are only allocated once
+// something is drawn on them, and are kept in a hash table with linear
+// probing; everywhere else is the background colour.
+struct canvas {
+    int width, height;   // Size, or 0 if unbounded in that direction.
+    uint32_t background;
+    uint32_t * pixels;   // Rows of pixels of a bounded canvas, or NULL.
+    tile ** tiles;       // Hash table of tiles, with empty slots NULL.
+    size_t capacity, n;  // Number of slots, and of tiles in use.
+    tile * last;         // The tile used most recently.
+    int x0, y0, x1, y1;  // Bounds of everything drawn, if x0 <= x1.
+};
+
+// Declare function signatures.
+static tile * find(canvas * c, int tx, int ty, bool create);
+static size_t hash(int tx, int ty, size_t mask);
+static void grow(canvas * c);
+static void bound(canvas * c, int x, int y);
+static int floorDiv(int a);
+static bool extent(canvas * c, int * x, int * y, int * w, int * h);
+static void getRow(canvas * c, int y, int x, int n, uint32_t * out);
+static void row(canvas * c, int y, int x0, int x1, uint32_t rgba);
+static void column(canvas * c, int x, int y0, int y1, uint32_t rgba);
+static void fill(uint32_t * p, size_t n, uint32_t rgba);
+static void plot(canvas * c, int x, int y, uint32_t rgba);
+static bool visible(canvas * c, int x0, int y0, int sx, int sy, int64_t a,
+                    int64_t b, int64_t * xs, int64_t * ys, int64_t * n);
+static bool within(int p, int s, int64_t n, int size, int64_t * lo,
+                   int64_t * hi);
+static int64_t ceilDiv(int64_t n, int64_t d);
+static void chunk(FILE * out, const char * type, unsigned char * data,
+                  uint32_t n);
+static uint32_t crc(uint32_t crc, unsigned char * data, size_t n);
+static void put32(unsigned char * p, uint32_t value);
+
+// The largest picture which will be exported, and the largest canvas which is
+// stored as a flat array, in pixels.  Lines at least LONGEST pixels long are
+// drawn from end to end, since the sums used to skip to the part on the canvas
+// could overflow.
+static const long LARGEST = 1L << 28;
+static const size_t FLAT = 1 << 24;
+static const int64_t LONGEST = 1 << 30;
+
+canvas * newCanvas(int width, int height, uint32_t rgba) {
+    canvas * c = (canvas *) malloc(sizeof(canvas));
+    c->width = width; c->height = height;
+    size_t size = (size_t) width * height;
+    bool flat = width > 0 && height > 0 && size <= FLAT;
+    c->pixels = flat ? malloc(size * sizeof(uint32_t)) : NULL;
+    c->capacity = flat ? 0 : 64; c->n = 0;
+    c->tiles = calloc(c->capacity, sizeof(tile *));
+    fillCanvas(c, rgba);
+    return c;
+}
+
+void freeCanvas(canvas * c) {
+    fillCanvas(c, c->background);
+    free(c->pixels);
+    free(c->tiles);
+    free(c);
+}
+
+void fillCanvas(canvas * c, uint32_t rgba) {
+    // Drop every tile, so that the whole canvas is background again.
+    for (size_t i = 0; i < c->capacity; i++) {
+        free(c->tiles[i]); c->tiles[i] = NULL;
+    }
+    c->n = 0; c->last = NULL;
+    c->background = rgba;
+    c->x0 = c->y0 = 0; c->x1 = c->y1 = -1;
+    if (c->pixels != NULL) {
+        fill(c->pixels, (size_t) c->width * c->height, rgba);
+    }
+}
+
+void drawLine(canvas * c, int x0, int y0, int x1, int y1, uint32_t rgba) {
+    // Keep track of the bounds of everything drawn, for exporting an unbounded
+    // canvas.
+    if (c->pixels == NULL) { bound(c, x0, y0); bound(c, x1, y1); }
+
+    // Axis-aligned lines are filled directly, without stepping pixel by pixel.
+    if (y0 == y1) { row(c, y0, x0, x1, rgba); return; }
+    if (x0 == x1) { column(c, x0, y0, y1, rgba); return; }
+
+    // Otherwise use Bresenham's algorithm, stepping in whichever direction is
+    // longer, from the first pixel which can be on the canvas to the last.
+    int64_t dx = llabs((int64_t) x1 - x0), dy = -llabs((int64_t) y1 - y0);
+    int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+    int64_t xs, ys, n;
+    if (!visible(c, x0, y0, sx, sy, dx, -dy, &xs, &ys, &n)) return;
+    x0 += sx * xs; y0 += sy * ys;
+    int64_t error = dx + dy + xs * dy + ys * dx;
+    if (c->pixels != NULL) {
+        for (int64_t k = 0; ; k++) {
+            plot(c, x0, y0, rgba);
+            if (k == n) break;
+            int64_t e2 = 2 * error;
+            if (e2 >= dy) { error += dy; x0 += sx; }
+            if (e2 <= dx) { error += dx; y0 += sy; }
+        }
+        return;
+    }
+    tile * t = NULL; int left = 0, top = 0;
+    unsigned w = c->width, h = c->height;
+    for (int64_t k = 0; ; k++) {
+        // Set the pixel if it is on the canvas, looking up its tile again only
+        // on crossing into a new one, whose top left corner is at (left, top).
+        unsigned lx = x0 - left, ly = y0 - top;
+        if ((w == 0 || (unsigned) x0 < w) && (h == 0 || (unsigned) y0 < h)) {
+            if (t == NULL || lx >= TILE || ly >= TILE) {
+                t = find(c, floorDiv(x0), floorDiv(y0), true);
+                left = t->tx * TILE; top = t->ty * TILE;
+                lx = x0 - left; ly = y0 - top;
+            }
+            t->pixels[ly * TILE + lx] = rgba;
+        }
+        if (k == n) break;
+        int64_t e2 = 2 * error;
+        if (e2 >= dy) { error += dy; x0 += sx; }
+        if (e2 <= dx) { error += dx; y0 += sy; }
+    }
+}
+
+void copyRow(canvas * c, int y, uint32_t * out) {
+    getRow(c, y, 0, c->width, out);
+}
+
+bool savePPM(canvas * c, char * path) {
+    int x0, y0, w, h;
+    if (!extent(c, &x0, &y0, &w, &h)) return false;
+
+    FILE * out = fopen(path, "wb");
+    if (!out) return false;
+
+    fprintf(out, "P6\n%d %d\n255\n", w, h);
+    uint32_t * p = malloc((size_t) w * sizeof(uint32_t));
+    unsigned char * row = malloc((size_t) w * 3);
+    for (int y = 0; y < h; y++) {
+        getRow(c, y0 + y, x0, w, p);
+        for (int x = 0; x < w; x++) {
+            row[3 * x] = p[x] >> 24;
+            row[3 * x + 1] = (p[x] >> 16) & 0xFF;
+            row[3 * x + 2] = (p[x] >> 8) & 0xFF;
+        }
+        fwrite(row, 3, w, out);
+    }
+    free(p); free(row);
+    return fclose(out) == 0;
+}
+
+bool digestCanvas(canvas * c, uint64_t * out) {
+    int x0, y0, w, h;
+    if (!extent(c, &x0, &y0, &w, &h)) return false;
+
+    // Use FNV-1a, taking a whole pixel at a time, and include the size so
+    // that pictures of different shapes don't collide.
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ (uint32_t) w) * 1099511628211ULL;
+    hash = (hash ^ (uint32_t) h) * 1099511628211ULL;
+    uint32_t * pixels = malloc((size_t) w * sizeof(uint32_t));
+    for (int y = 0; y < h; y++) {
+        getRow(c, y0 + y, x0, w, pixels);
+        for (int x = 0; x < w; x++) {
+            hash = (hash ^ pixels[x]) * 1099511628211ULL;
+        }
+    }
+    free(pixels);
+    *out = hash;
+    return true;
+}
+
+/*
+ * A PNG file is a signature followed by IHDR, IDAT and IEND chunks.  The image
+ * data is a zlib stream, which is written using uncompressed deflate blocks so
+ * that no compression library is needed.
+ *****************************************************/
+
+bool savePNG(canvas * c, char * path) {
+    int x0, y0, w, h;
+    if (!extent(c, &x0, &y0, &w, &h)) return false;
+
+    FILE * out = fopen(path, "wb");
+    if (!out) return false;
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, out);
+
+    // Describe the image as 8-bit RGBA, without interlacing.
+    unsigned char header[13] = {0};
+    put32(header, w); put32(header + 4, h);
+    header[8] = 8; header[9] = 6;
+    chunk(out, "IHDR", header, 13);
+
+    // Lay out the raw image data, with a filter type of 0 before each row.
+    size_t stride = 1 + 4 * (size_t) w;
+    size_t size = stride * h;
+    unsigned char * raw = malloc(size);
+    uint32_t * pixels = malloc((size_t) w * sizeof(uint32_t));
+    for (int y = 0; y < h; y++) {
+        unsigned char * row = raw + y * stride;
+        row[0] = 0;
+        getRow(c, y0 + y, x0, w, pixels);
+        for (int x = 0; x < w; x++) put32(row + 1 + 4 * x, pixels[x]);
+    }
+    free(pixels);
+
+    // Wrap the data in stored blocks of at most 65535 bytes each, followed by
+    // the Adler-32 checksum.
+    size_t blocks = size / 65535 + 1;
+    unsigned char * z = malloc(2 + size + 5 * blocks + 4), * p = z;
+    *p++ = 0x78; *p++ = 0x01;
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < size; i++) {
+        a = (a + raw[i]) % 65521; b = (b + a) % 65521;
+    }
+    for (size_t done = 0; done < size || p == z + 2; ) {
+        size_t n = size - done > 65535 ? 65535 : size - done;
+        *p++ = done + n == size;
+        *p++ = n & 0xFF; *p++ = n >> 8;
+        *p++ = ~n & 0xFF; *p++ = (~n >> 8) & 0xFF;
+        memcpy(p, raw + done, n); p += n; done += n;
+    }
+    put32(p, b << 16 | a); p += 4;
+    chunk(out, "IDAT", z, p - z);
+    chunk(out, "IEND", NULL, 0);
+
+    free(raw); free(z);
+    return fclose(out) == 0;
+}
+
+// Write a PNG chunk: its length, type, data, and a CRC of the type and data.
+static void chunk(FILE * out, const char * type, unsigned char * data,
+                  uint32_t n) {
+    unsigned char bytes[4];
+    put32(bytes, n); fwrite(bytes, 1, 4, out);
+    fwrite(type, 1, 4, out);
+    if (n > 0) fwrite(data, 1, n, out);
+    uint32_t sum = crc(crc(0xFFFFFFFF, (unsigned char *) type, 4), data, n);
+    put32(bytes, sum ^ 0xFFFFFFFF); fwrite(bytes, 1, 4, out);
+}
+
+// Update a CRC-32 with some more data.
+static uint32_t crc(uint32_t crc, unsigned char * data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+// Store a 32-bit value as 4 bytes, most significant first.
+static void put32(unsigned char * p, uint32_t value) {
+    p[0] = value >> 24; p[1] = (value >> 16) & 0xFF;
+    p[2] = (value >> 8) & 0xFF; p[3] = value & 0xFF;
+}
+
+/*****************************************************/
+
+/*
+ * Tiles are found by hashing their coordinates.  Nearly every lookup is for the
+ * same tile as the one before, so that one is remembered.
+ *****************************************************/
+
+// Find the tile with the given coordinates, creating it if asked to.  Return
+// NULL if it doesn't exist and wasn't created.
+static tile * find(canvas * c, int tx, int ty, bool create) {
+    if (c->last != NULL && c->last->tx == tx && c->last->ty == ty) {
+        return c->last;
+    }
+    size_t mask = c->capacity - 1, i = hash(tx, ty, mask);
+    for (; c->tiles[i] != NULL; i = (i + 1) & mask) {
+        tile * t = c->tiles[i];
+        if (t->tx == tx && t->ty == ty) return c->last = t;
+    }
+    if (!create) return NULL;
+
+    tile * t = malloc(sizeof(tile));
+    t->tx = tx; t->ty = ty;
+    fill(t->pixels, TILE * TILE, c->background);
+    c->tiles[i] = t; c->n++;
+    if (2 * c->n > c->capacity) grow(c);
+    return c->last = t;
+}
+
+// Find the slot at which to start looking for a tile.
+static size_t hash(int tx, int ty, size_t mask) {
+    return ((unsigned) tx * 0x9E3779B1u ^ (unsigned) ty * 0x85EBCA77u) & mask;
+}
+
+// Double the size of the hash table, and put every tile back in.
+static void grow(canvas * c) {
+    tile ** old = c->tiles; size_t n = c->capacity;
+    c->capacity *= 2; c->n = 0;
+    c->tiles = calloc(c->capacity, sizeof(tile *));
+    size_t mask = c->capacity - 1;
+    for (size_t j = 0; j < n; j++) {
+        tile * t = old[j];
+        if (t == NULL) continue;
+        size_t i = hash(t->tx, t->ty, mask);
+        while (c->tiles[i] != NULL) i = (i + 1) & mask;
+        c->tiles[i] = t; c->n++;
+    }
+    free(old);
+}
+
+// Widen the bounds of everything drawn to include a point.
+static void bound(canvas * c, int x, int y) {
+    if (c->x0 > c->x1) { c->x0 = c->x1 = x; c->y0 = c->y1 = y; }
+    if (x < c->x0) c->x0 = x;
+    if (x > c->x1) c->x1 = x;
+    if (y < c->y0) c->y0 = y;
+    if (y > c->y1) c->y1 = y;
+}
+
+// Find which tile a coordinate lies in, rounding down for negative ones.
+static int floorDiv(int a) {
+    return a >= 0 ? a >> SHIFT : ~(~a >> SHIFT);
+}
+
+// Find the part of the canvas to export: the whole of a bounded canvas, or the
+// bounds of everything drawn in an unbounded direction.  Return false if it is
+// too big to export.
+static bool extent(canvas * c, int * x, int * y, int * w, int * h) {
+    bool drawn = c->x0 <= c->x1;
+    long width = c->width, height = c->height;
+    if (width == 0) width = drawn ? (long) c->x1 - c->x0 + 1 : 1;
+    if (height == 0) height = drawn ? (long) c->y1 - c->y0 + 1 : 1;
+    *x = c->width > 0 || !drawn ? 0 : c->x0;
+    *y = c->height > 0 || !drawn ? 0 : c->y0;
+    *w = width; *h = height;
+    return width * height <= LARGEST;
+}
+
+// Copy n pixels of row y, starting at column x.
+static void getRow(canvas * c, int y, int x, int n, uint32_t * out) {
+    if (c->pixels != NULL) {
+        memcpy(out, &c->pixels[(size_t) y * c->width + x],
+               n * sizeof(uint32_t));
+        return;
+    }
+    int ty = floorDiv(y), ly = y - ty * TILE;
+    while (n > 0) {
+        int tx = floorDiv(x), lx = x - tx * TILE;
+        int k = TILE - lx < n ? TILE - lx : n;
+        tile * t = find(c, tx, ty, false);
+        if (t == NULL) fill(out, k, c->background);
+        else memcpy(out, &t->pixels[ly * TILE + lx], k * sizeof(uint32_t));
+        out += k; x += k; n -= k;
+    }
+}
+
+/*****************************************************/
+
+// Fill the part of row y between x0 and x1 which is on the canvas.
+static void row(canvas * c, int y, int x0, int x1, uint32_t rgba) {
+    if (c->height > 0 && (y < 0 || y >= c->height)) return;
+    if (x0 > x1) { int t = x0; x0 = x1; x1 = t; }
+    if (c->width > 0 && x0 < 0) x0 = 0;
+    if (c->width > 0 && x1 >= c->width) x1 = c->width - 1;
+    if (x0 > x1) return;
+    if (c->pixels != NULL) {
+        fill(&c->pixels[(size_t) y * c->width + x0], x1 - x0 + 1, rgba);
+        return;
+    }
+
+    // Fill the row a tile at a time.
+    int ty = floorDiv(y), ly = y - ty * TILE;
+    for (int x = x0; x <= x1; ) {
+        int tx = floorDiv(x), lx = x - tx * TILE;
+        int n = TILE - lx < x1 - x + 1 ? TILE - lx : x1 - x + 1;
+        fill(&find(c, tx, ty, true)->pixels[ly * TILE + lx], n, rgba);
+        x += n;
+    }
+}
+
+// Fill the part of column x between y0 and y1 which is on the canvas.
+static void column(canvas * c, int x, int y0, int y1, uint32_t rgba) {
+    if (c->width > 0 && (x < 0 || x >= c->width)) return;
+    if (y0 > y1) { int t = y0; y0 = y1; y1 = t; }
+    if (c->height > 0 && y0 < 0) y0 = 0;
+    if (c->height > 0 && y1 >= c->height) y1 = c->height - 1;
+    if (c->pixels != NULL) {
+        uint32_t * p = &c->pixels[(size_t) y0 * c->width + x];
+        for (int y = y0; y <= y1; y++, p += c->width) *p = rgba;
+        return;
+    }
+
+    // Fill the column a tile at a time.
+    int tx = floorDiv(x), lx = x - tx * TILE;
+    for (int y = y0; y <= y1; ) {
+        int ty = floorDiv(y), ly = y - ty * TILE;
+        int n = TILE - ly < y1 - y + 1 ? TILE - ly : y1 - y + 1;
+        uint32_t * p = &find(c, tx, ty, true)->pixels[ly * TILE + lx];
+        for (int k = 0; k < n; k++, p += TILE) *p = rgba;
+        y += n;
+    }
+}
+
+// Fill n consecutive pixels, four at a time where SSE2 is available.
+static void fill(uint32_t * p, size_t n, uint32_t rgba) {
+#ifdef __SSE2__
+    __m128i four = _mm_set1_epi32((int) rgba);
+    for (; n >= 4; n -= 4, p += 4) _mm_storeu_si128((__m128i *) p, four);
+#endif
+    while (n-- > 0) *p++ = rgba;
+}
+
+// Set a single pixel of a bounded canvas, if it is on the canvas.
+static void plot(canvas * c, int x, int y, uint32_t rgba) {
+    if (x < 0 || y < 0 || x >= c->width || y >= c->height) return;
+    c->pixels[(size_t) y * c->width + x] = rgba;
+}
+
+/*
+ * Bresenham's algorithm puts pixel k of a line, counting along its longer axis,
+ * k pixels along that axis from the start, and floor((2*minor*k + major) /
+ * (2*major)) along the other, where the line is major pixels long along the
+ * longer axis and minor along the other.  So the pixels which can be on the
+ * canvas can be found directly, and the algorithm started from the first of
+ * them, with the error term it would have had there.
+ *****************************************************/
+
+// Find the part of a line from (x0,y0), a pixels long along x and b along y in
+// directions sx and sy, which can be on the canvas: how many pixels along each
+// axis from the start it begins, and how many steps further it ends.  Return
+// false if no pixel of the line is on the canvas.
+static bool visible(canvas * c, int x0, int y0, int sx, int sy, int64_t a,
+                    int64_t b, int64_t * xs, int64_t * ys, int64_t * n) {
+    bool steep = b > a;
+    int64_t major = steep ? b : a, minor = steep ? a : b;
+    int64_t first = 0, last = major;
+    if (major < LONGEST) {
+        // Find the steps along the longer axis which are on the canvas, and
+        // unless the other axis is on it throughout, those on which it is.
+        int64_t lo, hi;
+        bool in = steep ? within(y0, sy, b, c->height, &first, &last)
+                        : within(x0, sx, a, c->width, &first, &last);
+        in = in && (steep ? within(x0, sx, a, c->width, &lo, &hi)
+                          : within(y0, sy, b, c->height, &lo, &hi));
+        if (!in) return false;
+        if (lo > 0 || hi < minor) {
+            lo = ceilDiv(2 * major * lo - major, 2 * minor);
+            hi = ceilDiv(2 * major * (hi + 1) - major, 2 * minor) - 1;
+            if (lo > first) first = lo;
+            if (hi < last) last = hi;
+        }
+        if (first > last) return false;
+    }
+    int64_t across = first == 0 ? 0 : (2 * minor * first + major) / (2 * major);
+    *xs = steep ? across : first;
+    *ys = steep ? first : across;
+    *n = last - first;
+    return true;
+}
+
+// Find the range of k from 0 to n for which p + s*k is from 0 to size - 1, or
+// all of them if size is 0, meaning unbounded.  Return false if there are none.
+static bool within(int p, int s, int64_t n, int size, int64_t * lo,
+                   int64_t * hi) {
+    *lo = 0; *hi = n;
+    if (size == 0) return true;
+    int64_t from = s > 0 ? -(int64_t) p : (int64_t) p - (size - 1);
+    int64_t to = s > 0 ? (int64_t) size - 1 - p : p;
+    if (from > *lo) *lo = from;
+    if (to < *hi) *hi = to;
+    return *lo <= *hi;
+}
+
+// Divide, rounding up, by a positive number.
+static int64_t ceilDiv(int64_t n, int64_t d) {
+    return n >= 0 ? (n + d - 1) / d : -(-n / d);
+}
+
+/*****************************************************/
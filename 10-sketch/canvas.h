@@ -0,0 +1,46 @@
+/* The canvas module provides an in-memory RGBA picture, with line drawing and
+export to PPM and PNG files.  It has no dependencies beyond the C library, so
+that sketches can be rendered on machines without a display.
+
+Colours are packed into integers as 0xRRGGBBAA.  Coordinates outside the
+canvas are allowed, and anything drawn there is discarded.  A canvas of an
+ordinary size is stored as a flat array of pixels.  A very large or unbounded
+one is stored as square tiles which are only allocated once something is drawn
+on them, so that it costs memory only where there is ink.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+
+// The canvas type is opaque (declared here, and defined in canvas.c).
+struct canvas;
+typedef struct canvas canvas;
+
+// Create a new canvas of the given size, filled with the given colour.  A width
+// or height of 0 makes the canvas unbounded in that direction.
+canvas *newCanvas(int width, int height, uint32_t rgba);
+
+// Free a canvas.
+void freeCanvas(canvas *c);
+
+// Fill the whole canvas with a colour.
+void fillCanvas(canvas *c, uint32_t rgba);
+
+// Draw a line from (x0,y0) to (x1,y1), including both end points.
+void drawLine(canvas *c, int x0, int y0, int x1, int y1, uint32_t rgba);
+
+// Copy row y of a bounded canvas into out, which has room for the whole row.
+void copyRow(canvas *c, int y, uint32_t *out);
+
+// The save functions write the whole of a bounded canvas.  In an unbounded
+// direction, they write just the extent of everything drawn since the canvas
+// was last filled.  They fail if the picture would be unreasonably large.
+
+// Write the canvas to a file as a binary PPM, dropping the alpha channel.
+bool savePPM(canvas *c, char *path);
+
+// Write the canvas to a file as an uncompressed RGBA PNG.
+bool savePNG(canvas *c, char *path);
+
+// Find a 64-bit digest of the pixels which the save functions would write.
+// Return false if there would be too many of them.
+bool digestCanvas(canvas *c, uint64_t *out);
@@ -1,20 +1,35 @@
 /* A small graphics module for line drawing, based on SDL.  The functions
-draw onto the window surface, and then call SDL_UpdateWindowSurface to display
+draw onto the window surface, and SDL_UpdateWindowSurface is called to display
 what has been drawn onto the screen.  A software renderer is used, since
-SDL's direct surface drawing functions don't include line drawing. */
+SDL's direct surface drawing functions don't include line drawing.
 
-#include "display.h"
+Updating the window after every line is slow for dense sketches, so drawing is
+batched: the window is only updated at a pause, a key wait, or the end, or when
+a frame's worth of time has passed since the last update.  Only the rectangles
+which have been drawn on since the last update are copied to the screen. */
+
+#include "backend.h"
 #include <SDL2/SDL.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-struct display {
+// The minimum time between window updates while drawing, in milliseconds, and
+// the number of rectangles tracked before they are combined into one.
+enum { FRAME = 16, RECTS = 64 };
+
+struct window {
+    display base;
     int width, height;
     SDL_Window *window;
     SDL_Renderer *renderer;
+    bool whole;   // Has the whole window been drawn on since the last update?
+    int n;        // The number of rectangles drawn on since the last update.
+    SDL_Rect dirty[RECTS];
+    Uint32 shown; // The time of the last update.
 };
+typedef struct window window;
 
 // If SDL fails, print the SDL error message, and stop the program.
 static void fail() {
@@ -27,9 +42,67 @@ static void fail() {
 void *notNull(void *p) { if (p == NULL) fail(); return p; }
 int notNeg(int n) { if (n < 0) fail(); return n; }
 
+// Update the parts of the window drawn on since the last update, if any.
+static void update(window *d) {
+    if (!d->whole && d->n == 0) return;
+    if (d->whole) SDL_UpdateWindowSurface(d->window);
+    else SDL_UpdateWindowSurfaceRects(d->window, d->dirty, d->n);
+    d->whole = false;
+    d->n = 0;
+    d->shown = SDL_GetTicks();
+}
+
+// Update the window and call the frame hook, if any.
+static void frame(window *d) {
+    update(d);
+    callHook(&d->base);
+}
+
+// Wait for a given number of milliseconds of virtual time, which the display
+// functions add to the virtual clock.
+static void delay(window *d, int ms) {
+    double speed = d->base.speed;
+    if (ms > 0 && speed > 0) SDL_Delay(ms / speed);
+}
+
+// Update the window if it is due.
+static void due(window *d) {
+    if (SDL_GetTicks() - d->shown >= FRAME) update(d);
+}
+
+// Note that the rectangle with corners (x0,y0) and (x1,y1) has been drawn on.
+static void drawn(window *d, int x0, int y0, int x1, int y1) {
+    // Clip the rectangle to the window.
+    if (x0 > x1) { int t = x0; x0 = x1; x1 = t; }
+    if (y0 > y1) { int t = y0; y0 = y1; y1 = t; }
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= d->width) x1 = d->width - 1;
+    if (y1 >= d->height) y1 = d->height - 1;
+    if (x0 > x1 || y0 > y1 || d->whole) return;
+
+    // When there are too many rectangles, replace them by their bounding box.
+    if (d->n == RECTS) {
+        SDL_Rect *r = d->dirty;
+        int left = r[0].x, top = r[0].y;
+        int right = r[0].x + r[0].w, bottom = r[0].y + r[0].h;
+        for (int i = 1; i < d->n; i++) {
+            if (r[i].x < left) left = r[i].x;
+            if (r[i].y < top) top = r[i].y;
+            if (r[i].x + r[i].w > right) right = r[i].x + r[i].w;
+            if (r[i].y + r[i].h > bottom) bottom = r[i].y + r[i].h;
+        }
+        r[0] = (SDL_Rect) { left, top, right - left, bottom - top };
+        d->n = 1;
+    }
+    d->dirty[d->n++] = (SDL_Rect) { x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+}
+
 // Create a new display object.
-display *newDisplay(char *title, int width, int height) {
-    display *d = malloc(sizeof(display));
+static display *sdlOpen(char *title, int width, int height) {
+    // A window needs a size, so use the default for a picture of any extent.
+    if (width <= 0 || height <= 0) { width = 200; height = 200; }
+    window *d = malloc(sizeof(window));
     d->width = width;
     d->height = height;
     notNeg(SDL_Init(SDL_INIT_VIDEO));
@@ -40,16 +113,22 @@ display *newDisplay(char *title, int width, int height) {
     SDL_SetRenderDrawColor(d->renderer, 255, 255, 255, 255);
     SDL_RenderClear(d->renderer);
     SDL_UpdateWindowSurface(d->window);
-    return d;
+    d->whole = false;
+    d->n = 0;
+    d->shown = SDL_GetTicks();
+    return &d->base;
 }
 
-void line(display *d, int x0, int y0, int x1, int y1) {
+static void sdlLine(display *base, int x0, int y0, int x1, int y1) {
+    window *d = (window *) base;
     SDL_SetRenderDrawColor(d->renderer, 0, 0, 0, 255);
     notNeg(SDL_RenderDrawLine(d->renderer, x0, y0, x1, y1));
-    SDL_UpdateWindowSurface(d->window);
+    drawn(d, x0, y0, x1, y1);
+    due(d);
 }
 
-void colour(display *d, int rgba) {
+static void sdlColour(display *base, int rgba) {
+    window *d = (window *) base;
     int r = (rgba >> 24) & 0xFF;
     int g = (rgba >> 16) & 0xFF;
     int b = (rgba >> 8) & 0xFF;
@@ -57,19 +136,28 @@ void colour(display *d, int rgba) {
     notNeg(SDL_SetRenderDrawColor(d->renderer, r, g, b, a));
 }
 
-void clear(display *d) {
+static void sdlClear(display *base) {
+    window *d = (window *) base;
     SDL_SetRenderDrawColor(d->renderer, 255, 255, 255, 255);
     SDL_RenderClear(d->renderer);
-    SDL_UpdateWindowSurface(d->window);
+    d->whole = true;
+    due(d);
 }
 
-void pause(display *d, int ms) {
-    if (ms > 0) SDL_Delay(ms);
+static void sdlPause(display *base, int ms) {
+    window *d = (window *) base;
+    frame(d);
+    delay(d, ms);
 }
 
-char key(display *d) {
+static void sdlShow(display *d) {
+    update((window *) d);
+}
+
+static char sdlKey(display *d) {
     SDL_Event event_structure;
     SDL_Event *event = &event_structure;
+    frame((window *) d);
     while (true) {
         int r = SDL_WaitEvent(event);
         if (r == 0) fail("Bad event", "");
@@ -84,7 +172,42 @@ char key(display *d) {
     }
 }
 
-void end(display *d) {
-    SDL_Delay(5000);
+static bool sdlEnd(display *base) {
+    window *d = (window *) base;
+    frame(d);
+    delay(d, 5000);
     SDL_Quit();
+    free(d);
+    return true;
 }
+
+static void sdlDiscard(display *d) {
+    SDL_Quit();
+    free(d);
+}
+
+// Copy the window surface in RGB format, and write it out.
+static bool sdlSnapshot(display *d, char *path) {
+    window *w = (window *) d;
+    SDL_Surface *surface = notNull(SDL_GetWindowSurface(w->window));
+    SDL_Surface *rgb = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGB24, 0);
+    if (rgb == NULL) return false;
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) { SDL_FreeSurface(rgb); return false; }
+    fprintf(out, "P6\n%d %d\n255\n", rgb->w, rgb->h);
+    SDL_LockSurface(rgb);
+    for (int y = 0; y < rgb->h; y++) {
+        fwrite((char *) rgb->pixels + y * rgb->pitch, 3, rgb->w, out);
+    }
+    SDL_UnlockSurface(rgb);
+    SDL_FreeSurface(rgb);
+    return fclose(out) == 0;
+}
+
+// The window holds pixels in its own format, so it has no digest comparable
+// with other displays.
+const backend sdlBackend = {
+    .name = "sdl", .open = sdlOpen, .line = sdlLine, .colour = sdlColour,
+    .pause = sdlPause, .clear = sdlClear, .show = sdlShow, .key = sdlKey,
+    .end = sdlEnd, .discard = sdlDiscard, .snapshot = sdlSnapshot
+};
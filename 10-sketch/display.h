@@ -1,12 +1,44 @@
-// You do not need to change this file.
 // The display module provides graphics for the sketch program.
+#include <stdbool.h>
+#include <stdint.h>
 
 // A display structure needs to be created by calling newDisplay, and then
-// needs to be passed to each sketching function.
+// needs to be passed to each sketching function.  Displays are drawn by one of
+// several backends, such as an SDL window or a headless framebuffer.
 struct display;
 typedef struct display display;
 
+// Choose the backend used by newDisplay from now on, by name: sdl, framebuffer,
+// null, trace, test or video.  Return false if no backend of that name is built
+// in.  Until one is chosen, the default for the build is used.
+bool useBackend(char *name);
+
+// Find the name of the i'th backend built in, or NULL if there are fewer.
+char *backendName(int i);
+
+// Find the name of the backend used by newDisplay, settling on the default for
+// the build if none has been chosen.  Programs which create displays on several
+// threads call this first, so that the threads don't settle it at once.
+char *chosenBackend();
+
+// Choose whether displays created by newDisplay from now on draw on a render
+// thread of their own, so that the caller can carry on while lines are drawn.
+// Pauses are queued along with the drawing, and the frame hook is called on the
+// render thread, so it mustn't share anything with the caller unguarded.  Key
+// waits and the end wait for the drawing to catch up.
+void useRenderThread(bool on);
+
+// Script the key presses for displays created by newDisplay from now on, as n
+// keys and the virtual times, in milliseconds, at which they are pressed.  Each
+// key wait takes the next key in the script without blocking, pausing until
+// the key's time if that is still to come.  Once the script runs out, key
+// waits go back to the display's own keyboard, if it has one.
+void typeKeys(int n, long *times, char *keys);
+
 // Create a display object representing a plain white window of a given size.
+// A size of 0 by 0 asks for the whole of the picture, however far it extends:
+// a headless display keeps everything drawn, and a window falls back to its
+// default size.
 display *newDisplay(char *title, int width, int height);
 
 // Draw a line from (x0,y0) to (x1,y1) which is black by default.
@@ -18,11 +50,44 @@ void colour(display *d, int rgba);
 // Pause for the given number of milliseconds.
 void pause(display *d, int ms);
 
+// Skip part of a sketch: move the virtual clock on by ms, and use up the next
+// keys scripted keys, as the pauses and key waits skipped would have, but at
+// once, without any delay or call of the frame hook.
+void skip(display *d, long ms, int keys);
+
 // Clear the display to white.
 void clear(display *d);
 
+// Make sure that everything drawn so far is visible.
+void show(display *d);
+
 // Wait for a key press.
 char key(display *d);
 
-// Hold the display for a few seconds, then shut down.
-void end(display *d);
+// Hold the display for a few seconds, then shut down.  Return false if the
+// display failed, such as when its picture can't be saved.
+bool end(display *d);
+
+// Shut the display down at once, without holding or saving the picture, as
+// when the sketch has failed.
+void discard(display *d);
+
+// Scale the real time taken by pauses and by end, so that a factor of 2 plays
+// back twice as fast, and a factor of 0 skips all delays.  The display keeps a
+// virtual clock, which pauses always advance by their full length.
+void speed(display *d, double factor);
+
+// A frame hook is given the display's virtual time in milliseconds.
+typedef void frameHook(display *d, long ms, void *arg);
+
+// Call a hook at every pause, key wait and end, once the picture for that
+// moment has been drawn.
+void onFrame(display *d, frameHook *hook, void *arg);
+
+// Save the current picture as a PPM file.  Return false if the display has no
+// picture or the file can't be written.
+bool snapshot(display *d, char *path);
+
+// Find a 64-bit digest of the current picture, which changes whenever any of
+// its pixels do.  Return false if the display has no picture.
+bool digest(display *d, uint64_t *out);
@@ -0,0 +1,104 @@
+/* A headless implementation of the display module, which draws into an
+in-memory canvas instead of a window.  There are no delays, and nothing is
+shown; instead, end() writes the picture to a file named after the sketch, with
+its .sketch extension replaced by .ppm, or by .png if the environment variable
+SKETCH_FORMAT is set to png; nothing is written if it is set to none.  A
+display of size 0 by 0 has an unbounded canvas, and writes out just the part of
+it which has been drawn on. */
+
+#include "backend.h"
+#include "canvas.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct framebuffer {
+    display base;
+    char *title;
+    canvas *canvas;
+    uint32_t rgba;
+};
+typedef struct framebuffer framebuffer;
+
+// Create a new display object, with a white canvas and a black pen.
+static display *fbOpen(char *title, int width, int height) {
+    framebuffer *d = malloc(sizeof(framebuffer));
+    d->title = title;
+    d->canvas = newCanvas(width, height, 0xFFFFFFFF);
+    d->rgba = 0x000000FF;
+    return &d->base;
+}
+
+static void fbLine(display *base, int x0, int y0, int x1, int y1) {
+    framebuffer *d = (framebuffer *) base;
+    drawLine(d->canvas, x0, y0, x1, y1, d->rgba);
+}
+
+static void fbColour(display *d, int rgba) {
+    ((framebuffer *) d)->rgba = (uint32_t) rgba;
+}
+
+static void fbClear(display *d) {
+    fillCanvas(((framebuffer *) d)->canvas, 0xFFFFFFFF);
+}
+
+// Pauses take no real time, since nobody is watching.
+static void fbPause(display *d, int ms) {
+    callHook(d);
+}
+
+// Nothing is shown until the picture is written out.
+static void fbShow(display *d) {
+}
+
+// There is no keyboard, so carry on as if a key had been pressed.
+static char fbKey(display *d) {
+    callHook(d);
+    return '?';
+}
+
+// Write out the picture, and free the display.
+static bool fbEnd(display *base) {
+    callHook(base);
+    framebuffer *d = (framebuffer *) base;
+    char *format = getenv("SKETCH_FORMAT");
+    bool png = format != NULL && strcmp(format, "png") == 0;
+    bool none = format != NULL && strcmp(format, "none") == 0;
+
+    // Swap the .sketch extension, if any, for the output format's.
+    int n = strlen(d->title);
+    char path[n + 5];
+    strcpy(path, d->title);
+    char *dot = strrchr(path, '.');
+    if (dot != NULL && strcmp(dot, ".sketch") == 0) n = dot - path;
+    strcpy(path + n, png ? ".png" : ".ppm");
+
+    bool ok = true;
+    if (png) ok = savePNG(d->canvas, path);
+    else if (!none) ok = savePPM(d->canvas, path);
+    if (!ok) fprintf(stderr, "Error: can't write %s\n", path);
+    freeCanvas(d->canvas);
+    free(d);
+    return ok;
+}
+
+static void fbDiscard(display *base) {
+    framebuffer *d = (framebuffer *) base;
+    freeCanvas(d->canvas);
+    free(d);
+}
+
+static bool fbSnapshot(display *d, char *path) {
+    return savePPM(((framebuffer *) d)->canvas, path);
+}
+
+static bool fbDigest(display *d, uint64_t *out) {
+    return digestCanvas(((framebuffer *) d)->canvas, out);
+}
+
+const backend framebufferBackend = {
+    .name = "framebuffer", .open = fbOpen, .line = fbLine,
+    .colour = fbColour, .pause = fbPause, .clear = fbClear, .show = fbShow,
+    .key = fbKey, .end = fbEnd, .discard = fbDiscard, .snapshot = fbSnapshot,
+    .digest = fbDigest
+};
@@ -0,0 +1,47 @@
+/* An implementation of the display module which does nothing at all, apart
+from calling the frame hook.  It is used to measure the speed of the
+interpreter on its own. */
+
+#include "backend.h"
+#include <stdlib.h>
+
+static display *nullOpen(char *title, int width, int height) {
+    return malloc(sizeof(display));
+}
+
+static void nullLine(display *d, int x0, int y0, int x1, int y1) {
+}
+
+static void nullColour(display *d, int rgba) {
+}
+
+static void nullClear(display *d) {
+}
+
+static void nullPause(display *d, int ms) {
+    callHook(d);
+}
+
+static void nullShow(display *d) {
+}
+
+static char nullKey(display *d) {
+    callHook(d);
+    return '?';
+}
+
+static bool nullEnd(display *d) {
+    callHook(d);
+    free(d);
+    return true;
+}
+
+static void nullDiscard(display *d) {
+    free(d);
+}
+
+const backend nullBackend = {
+    .name = "null", .open = nullOpen, .line = nullLine, .colour = nullColour,
+    .pause = nullPause, .clear = nullClear, .show = nullShow, .key = nullKey,
+    .end = nullEnd, .discard = nullDiscard
+};
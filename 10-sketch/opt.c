@@ -0,0 +1,144 @@
+/*
+ * opt.c - rewrite a sketch into an equivalent, smaller one
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimize.h"
+
+// Declare function signatures.
+unsigned char * load(char * path, long * size);
+long save(program * prog, char * path);
+long copy(unsigned char * bytes, long n, char * path);
+long measure(program * prog);
+bool balanced(program * prog);
+bool verify(program * original, program * optimized);
+
+int main(int argc, char * argv[]) {
+    bool flat = argc == 4 && strcmp(argv[1], "--no-loops") == 0;
+    if (argc != 3 && !flat) {
+        fprintf(stderr,
+                "Usage: ./sketch-opt [--no-loops] [in.sketch] [out.sketch]\n");
+        return 1;
+    }
+    char * from = argv[argc - 2], * to = argv[argc - 1];
+
+    // Roll repeated runs up into repeat blocks, unless the output is for
+    // players which don't know them.
+    long before; unsigned char * bytes = load(from, &before);
+    if (bytes == NULL) return 1;
+    program * prog = compile(bytes, bytes + before);
+    if (prog == NULL) { free(bytes); return 1; }
+    if (!balanced(prog)) {
+        fprintf(stderr, "error: %s: unmatched repeat block\n", from);
+        return 1;
+    }
+    program * better = optimize(prog);
+    if (!flat) {
+        program * rolled = roll(better);
+        freeProgram(better);
+        better = rolled;
+    }
+
+    // Refuse to write anything unless the new program is equivalent, and keep
+    // the original if the new one is no smaller, as when its own repeat
+    // blocks were better than the ones found.
+    if (!verify(prog, better)) return 1;
+    bool smaller = measure(better) < before;
+    long after = smaller ? save(better, to) : copy(bytes, before, to);
+    if (after < 0) {
+        fprintf(stderr, "error: %s: %s\n", to, strerror(errno));
+        return 1;
+    }
+
+    if (smaller) {
+        printf("%s: %d instructions, %ld bytes -> %d instructions, %ld "
+               "bytes\n", from, prog->length, before, better->length, after);
+    } else {
+        printf("%s: %d instructions, %ld bytes, kept as it is\n",
+               from, prog->length, before);
+    }
+    free(bytes); freeProgram(prog); freeProgram(better);
+    return 0;
+}
+
+// Read a whole sketch file.
+unsigned char * load(char * path, long * size) {
+    FILE * in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    unsigned char * bytes = NULL; long n = 0, capacity = 0;
+    while (true) {
+        if (n == capacity) {
+            capacity = (capacity + 1) * 2;
+            bytes = realloc(bytes, capacity);
+        }
+        size_t got = fread(bytes + n, 1, capacity - n, in);
+        if (got == 0) break;
+        n += got;
+    }
+    fclose(in);
+    *size = n;
+    return bytes;
+}
+
+// Encode and write a program, returning its size in bytes, or -1 on error.
+long save(program * prog, char * path) {
+    FILE * out = fopen(path, "wb");
+    if (!out) return -1;
+    long size = 0;
+    unsigned char bytes[5];
+    for (int j = 0; j < prog->length; j++) {
+        int n = encode(prog->code[j], bytes);
+        fwrite(bytes, 1, n, out); size += n;
+    }
+    return fclose(out) == 0 ? size : -1;
+}
+
+// Write n bytes as they are, returning n, or -1 on error.
+long copy(unsigned char * bytes, long n, char * path) {
+    FILE * out = fopen(path, "wb");
+    if (!out) return -1;
+    bool ok = fwrite(bytes, 1, n, out) == (size_t) n;
+    return fclose(out) == 0 && ok ? n : -1;
+}
+
+// Find the size of a program once it is encoded, in bytes.
+long measure(program * prog) {
+    long size = 0;
+    unsigned char bytes[5];
+    for (int j = 0; j < prog->length; j++) size += encode(prog->code[j], bytes);
+    return size;
+}
+
+// Check that every repeat block is closed, and only once, as the interpreter
+// rejects programs where they aren't.
+bool balanced(program * prog) {
+    int depth = 0;
+    for (int j = 0; j < prog->length && depth >= 0; j++) {
+        if (prog->code[j].opcode == LP) depth++;
+        else if (prog->code[j].opcode == NX) depth--;
+    }
+    return depth == 0;
+}
+
+// Check that two programs make the same calls, reporting the first that
+// differs in the style of test.c.
+bool verify(program * original, program * optimized) {
+    trace * t1 = traceProgram(original), * t2 = traceProgram(optimized);
+    int i = compareTraces(t1, t2);
+    if (i >= 0) {
+        char expect[100] = "nothing", got[100] = "nothing";
+        if (i < t1->length) showCall(expect, &t1->calls[i]);
+        if (i < t2->length) showCall(got, &t2->calls[i]);
+        fprintf(stderr, "Failure in optimization\n");
+        fprintf(stderr, "Call %s\nExpecting %s\n", got, expect);
+    }
+    freeTrace(t1); freeTrace(t2);
+    return i < 0;
+}
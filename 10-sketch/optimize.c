@@ -0,0 +1,218 @@
+/*
+ * optimize.c - peephole optimisation of sketch programs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "optimize.h"
+
+// Define a structure for the state of a program as it is run.
+struct state {
+    int sx, sy; // Stored coordinates of cursor.
+    int cx, cy; // Current coordinates of cursor.
+    bool PD;    // Is the pen down?
+};
+typedef struct state state;
+
+// The longest run of instructions which is looked for as the body of a loop.
+enum { BODY = 64 };
+
+// Declare function signatures.
+static void record(trace * t, call c);
+static bool merge(call * l1, call * l2);
+static int sign(int n);
+static void emit(program * prog, int opcode, int operand);
+static void rollRange(program * out, instruction * code, int n);
+static bool repeats(instruction * a, instruction * b, int n);
+static int size(instruction * code, int n);
+
+trace * traceProgram(program * prog) {
+    trace * t = (trace *) malloc(sizeof(trace));
+    *t = (trace) { 0, 0, NULL };
+    state S = { 0, 0, 0, 0, false };
+
+    // Follow repeat blocks, with the start and remaining count of each.
+    int start[LOOPS], count[LOOPS], depth = 0;
+
+    for (int j = 0; j < prog->length; j++) {
+        instruction i = prog->code[j];
+        if (i.opcode == DX) {
+            S.cx += i.operand;
+        } else if (i.opcode == DY) {
+            S.cy += i.operand;
+            if (S.PD) record(t, (call) { LINE, S.sx, S.sy, S.cx, S.cy });
+            S.sx = S.cx; S.sy = S.cy;
+        } else if (i.opcode == DT) {
+            record(t, (call) { PAUSE, i.operand * 10 });
+        } else if (i.opcode == PN) {
+            S.PD = !S.PD;
+        } else if (i.opcode == CL) {
+            record(t, (call) { CLEAR });
+        } else if (i.opcode == KY) {
+            record(t, (call) { KEY });
+        } else if (i.opcode == HU) {
+            record(t, (call) { COLOUR, i.operand });
+        } else if (i.opcode == LP && i.operand <= 0) {
+            j = skipBlockAt(prog, j + 1) - 1;
+            if (j < 0) break;
+        } else if (i.opcode == LP && depth < LOOPS) {
+            start[depth] = j; count[depth++] = i.operand;
+        } else if (i.opcode == NX && depth > 0) {
+            if (--count[depth - 1] > 0) j = start[depth - 1];
+            else depth--;
+        }
+    }
+    return t;
+}
+
+void freeTrace(trace * t) {
+    free(t->calls);
+    free(t);
+}
+
+int compareTraces(trace * t1, trace * t2) {
+    int n = t1->length < t2->length ? t1->length : t2->length;
+    for (int i = 0; i < n; i++) {
+        call * c1 = &t1->calls[i], * c2 = &t2->calls[i];
+        bool same = c1->kind == c2->kind && c1->a == c2->a && c1->b == c2->b &&
+                    c1->c == c2->c && c1->d == c2->d;
+        if (!same) return i;
+    }
+    return t1->length == t2->length ? -1 : n;
+}
+
+void showCall(char * out, call * c) {
+    if (c->kind == LINE) {
+        sprintf(out, "line(d,%d,%d,%d,%d)", c->a, c->b, c->c, c->d);
+    } else if (c->kind == PAUSE) {
+        sprintf(out, "pause(d,%d)", c->a);
+    } else if (c->kind == COLOUR) {
+        sprintf(out, "colour(d,0x%08x)", (unsigned) c->a);
+    } else if (c->kind == CLEAR) {
+        sprintf(out, "clear(d)");
+    } else {
+        sprintf(out, "key(d)");
+    }
+}
+
+program * optimize(program * prog) {
+    trace * t = traceProgram(prog);
+    program * out = newProgram();
+
+    // Regenerate the program from its canonical trace.  Positions in the trace
+    // are absolute, so the pen can go straight from one line to the next.
+    state S = { 0, 0, 0, 0, false };
+    for (int j = 0; j < t->length; j++) {
+        call * c = &t->calls[j];
+        if (c->kind == PAUSE) emit(out, DT, c->a / 10);
+        else if (c->kind == COLOUR) emit(out, HU, c->a);
+        else if (c->kind == CLEAR) emit(out, CL, 0);
+        else if (c->kind == KEY) emit(out, KY, 0);
+        if (c->kind != LINE) continue;
+
+        // Move to the start of the line with the pen up, if not already there.
+        if (S.sx != c->a || S.sy != c->b) {
+            if (S.PD) { emit(out, PN, 0); S.PD = false; }
+            if (S.cx != c->a) emit(out, DX, c->a - S.cx);
+            emit(out, DY, c->b - S.cy);
+            S.sx = S.cx = c->a; S.sy = S.cy = c->b;
+        }
+
+        // Draw the line with the pen down.
+        if (!S.PD) { emit(out, PN, 0); S.PD = true; }
+        if (S.cx != c->c) emit(out, DX, c->c - S.cx);
+        emit(out, DY, c->d - S.cy);
+        S.sx = S.cx = c->c; S.sy = S.cy = c->d;
+    }
+
+    freeTrace(t);
+    return out;
+}
+
+program * roll(program * prog) {
+    program * out = newProgram();
+    rollRange(out, prog->code, prog->length);
+    return out;
+}
+
+// Add the n instructions from code to the end of a program, rolling up runs
+// which repeat.  At each point, the body which saves the most bytes is chosen,
+// and then rolled in turn.
+static void rollRange(program * out, instruction * code, int n) {
+    for (int j = 0; j < n; ) {
+        int best = 0, times = 0, saving = 0;
+        for (int length = 1; length <= BODY && j + 2 * length <= n; length++) {
+            int k = 1;
+            while (j + (k + 1) * length <= n &&
+                   repeats(&code[j], &code[j + k * length], length)) k++;
+            if (k < 2) continue;
+            instruction block[2] = { { LP, k }, { NX, 0 } };
+            int saved = (k - 1) * size(&code[j], length) - size(block, 2);
+            if (saved > saving) { best = length; times = k; saving = saved; }
+        }
+        if (best == 0) { append(out, code[j++]); continue; }
+        emit(out, LP, times);
+        rollRange(out, &code[j], best);
+        emit(out, NX, 0);
+        j += best * times;
+    }
+}
+
+// Check whether two runs of n instructions are the same.
+static bool repeats(instruction * a, instruction * b, int n) {
+    for (int j = 0; j < n; j++) {
+        if (a[j].opcode != b[j].opcode || a[j].operand != b[j].operand) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Find the number of bytes taken by n instructions.
+static int size(instruction * code, int n) {
+    unsigned char bytes[5]; int total = 0;
+    for (int j = 0; j < n; j++) total += encode(code[j], bytes);
+    return total;
+}
+
+// Add a call to the end of a trace, merging a line into the previous one
+// where that doesn't change the picture.
+static void record(trace * t, call c) {
+    if (t->length > 0 && merge(&t->calls[t->length - 1], &c)) return;
+    if (t->length == t->capacity) {
+        t->capacity = (t->capacity + 1) * 2;
+        t->calls = realloc(t->calls, t->capacity * sizeof(call));
+    }
+    t->calls[t->length++] = c;
+}
+
+// Try to merge line l2 into line l1, which it must directly follow.
+static bool merge(call * l1, call * l2) {
+    if (l1->kind != LINE || l2->kind != LINE) return false;
+    if (l1->c != l2->a || l1->d != l2->b) return false;
+    int dx1 = l1->c - l1->a, dy1 = l1->d - l1->b;
+    int dx2 = l2->c - l2->a, dy2 = l2->d - l2->b;
+
+    // A point at the end of a line is already covered by it.
+    if (dx2 == 0 && dy2 == 0) return true;
+    if (dx1 == 0 && dy1 == 0) { *l1 = *l2; return true; }
+
+    // Otherwise, both lines must go in the same direction, which must be one
+    // that is rasterized exactly.
+    if (sign(dx1) != sign(dx2) || sign(dy1) != sign(dy2)) return false;
+    bool straight = dx1 == 0 || dy1 == 0;
+    bool diagonal = abs(dx1) == abs(dy1) && abs(dx2) == abs(dy2);
+    if (!straight && !diagonal) return false;
+    l1->c = l2->c; l1->d = l2->d;
+    return true;
+}
+
+static int sign(int n) {
+    return (n > 0) - (n < 0);
+}
+
+// Add an instruction to the end of a program.
+static void emit(program * prog, int opcode, int operand) {
+    append(prog, (instruction) { opcode, operand });
+}
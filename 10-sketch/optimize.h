@@ -0,0 +1,46 @@
+/* The optimize module rewrites a sketch program into an equivalent, smaller
+one.  Two programs are equivalent if they make the same calls on a display, in
+the same order, once each series of lines with no other call between them has
+been put into a canonical form: consecutive lines which continue in the same
+direction, and which are horizontal, vertical or diagonal so that they cover
+exactly the same pixels whether they are drawn in one piece or two, are
+merged, and points drawn at the end of a neighbouring line are dropped.
+Repeated runs of instructions can then be rolled up into repeat blocks.
+*/
+#include <stdbool.h>
+
+#include "program.h"
+
+// The kinds of call a program makes on a display.
+enum { LINE, PAUSE, COLOUR, CLEAR, KEY };
+
+// A call, with up to four arguments.
+struct call { int kind; int a, b, c, d; };
+typedef struct call call;
+
+// A trace is the series of calls that a program makes, in canonical form.
+struct trace { int length, capacity; call *calls; };
+typedef struct trace trace;
+
+// Run a program without a display, and record its canonical trace.
+trace *traceProgram(program *prog);
+
+// Free a trace.
+void freeTrace(trace *t);
+
+// Compare two traces.  Return the index of the first call which differs, or
+// -1 if they are the same.
+int compareTraces(trace *t1, trace *t2);
+
+// Write a call in the same form as test.c, e.g. "line(d,30,30,60,30)".
+void showCall(char *out, call *c);
+
+// Create a new program which is equivalent to the given one, where every
+// line is drawn by a single pen-down move, and moves with the pen up are
+// combined.
+program *optimize(program *prog);
+
+// Create a new program which is equivalent to the given one, where each run of
+// instructions which repeats is put in a repeat block, if that saves space.
+// The body of a block can itself hold blocks.
+program *roll(program *prog);
@@ -0,0 +1,288 @@
+/*
+ * program.c - decoding of sketch bytecode into instruction arrays
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "program.h"
+
+// Sidecar files start with this magic string, followed by a version byte,
+// and a header of HEADER bytes in all.
+static const char MAGIC[4] = "SKC";
+static const int VERSION = 2;
+enum { HEADER = 28 };
+
+// Describe the instruction starting with byte b, for the decoding table.
+#define OPCODE(b) ((b) >> 6 != PN ? (b) >> 6 : ((b) & 0xF) <= NX ? (b) & 0xF : -1)
+#define OPERAND(b) ((b) >> 6 == PN ? 0 : \
+    (b) >> 6 != DT && ((b) & 0x20) ? ((b) & 0x3F) - 64 : (b) & 0x3F)
+#define EXTRA(b) ((b) >> 6 != PN ? 0 : (((b) >> 4) & 3) == 3 ? 4 : ((b) >> 4) & 3)
+
+// Expand the table entries for 4, 16 and 64 consecutive bytes.
+#define ENTRY(b) { OPCODE(b), OPERAND(b), EXTRA(b) }
+#define ROW4(b) ENTRY(b), ENTRY(b + 1), ENTRY(b + 2), ENTRY(b + 3)
+#define ROW16(b) ROW4(b), ROW4(b + 4), ROW4(b + 8), ROW4(b + 12)
+#define ROW64(b) ROW16(b), ROW16(b + 16), ROW16(b + 32), ROW16(b + 48)
+
+const entry decoding[256] = { ROW64(0), ROW64(64), ROW64(128), ROW64(192) };
+
+const char * const mnemonics[] = {
+    "dx", "dy", "dt", "pen", "clear", "key", "hue", "loop", "next"
+};
+
+// Declare function signatures.
+static int bytes_to_int(int n, const unsigned char bytes[4]);
+static bool fits(int32_t operand);
+static void put(unsigned char * p, uint64_t value, int n);
+static uint64_t get(const unsigned char * p, int n);
+
+int width(int byte) {
+    return 1 + decoding[byte].extra;
+}
+
+int decode(const unsigned char * p, const unsigned char * end, instruction * i) {
+    const entry * e = &decoding[*p];
+    int n = e->extra;
+    if (end - p < 1 + n) return 0;
+    if (e->opcode < 0) return -1;
+
+    // Single-byte instructions are fully described by the table.
+    if (n == 0) {
+        *i = (instruction) { e->opcode, e->operand };
+        return 1;
+    }
+
+    // Extension instructions take their operand from the following bytes.
+    unsigned char operand_bytes[4] = {0};
+    memcpy(operand_bytes, p + 1, n);
+    int operand;
+    if (e->opcode == HU) {
+        // Pack the colour into an integer.
+        uint32_t rgba = 0;
+        rgba |= ((uint32_t) operand_bytes[0]) << 24;
+        rgba |= ((uint32_t) operand_bytes[1]) << 16;
+        rgba |= ((uint32_t) operand_bytes[2]) << 8;
+        rgba |= (uint32_t) operand_bytes[3];
+        operand = (int) rgba;
+    } else {
+        operand = bytes_to_int(n, operand_bytes);
+    }
+    *i = (instruction) { e->opcode, operand };
+    return 1 + n;
+}
+
+int encode(instruction i, unsigned char bytes[5]) {
+    int32_t v = i.operand;
+    int n;
+
+    // Use a single byte for small moves and pauses, with a 6-bit operand.
+    bool small = i.opcode == DT ? v >= 0 && v < 64 : v >= -32 && v < 32;
+    if (i.opcode <= DT && small) {
+        bytes[0] = (unsigned char) (i.opcode << 6 | (v & 0x3F));
+        return 1;
+    }
+
+    // Otherwise choose the fewest operand bytes.  Colours are stored from
+    // their most significant byte, so trailing zero bytes can be dropped.
+    uint32_t u = (uint32_t) v;
+    bool bare = i.opcode == PN || i.opcode == CL || i.opcode == KY ||
+                i.opcode == NX;
+    if (bare || u == 0) n = 0;
+    else if (i.opcode == HU) {
+        n = (u & 0xFFFFFF) == 0 ? 1 : (u & 0xFFFF) == 0 ? 2 : 4;
+    }
+    else if (v >= 0 && v < 256) n = 1;
+    else if (v >= -32768 && v < 32768) n = 2;
+    else n = 4;
+
+    bytes[0] = (unsigned char) (PN << 6 | (n == 4 ? 3 : n) << 4 | i.opcode);
+    if (i.opcode == HU) u >>= 8 * (4 - n);
+    for (int j = 0; j < n; j++) {
+        bytes[1 + j] = (unsigned char) (u >> (8 * (n - 1 - j)));
+    }
+    return 1 + n;
+}
+
+const unsigned char * skipBlock(const unsigned char * p,
+                                const unsigned char * end) {
+    int depth = 1;
+    while (p < end) {
+        instruction i;
+        int used = decode(p, end, &i);
+        if (used <= 0) return NULL;
+        p += used;
+        if (i.opcode == LP) depth++;
+        else if (i.opcode == NX && --depth == 0) return p;
+    }
+    return NULL;
+}
+
+int skipBlockAt(program * prog, int j) {
+    int depth = 1;
+    for (; j < prog->length; j++) {
+        int opcode = prog->code[j].opcode;
+        if (opcode == LP) depth++;
+        else if (opcode == NX && --depth == 0) return j + 1;
+    }
+    return -1;
+}
+
+program * newProgram() {
+    program * prog = (program *) malloc(sizeof(program));
+    *prog = (program) { 0, 0, NULL };
+    return prog;
+}
+
+void append(program * prog, instruction i) {
+    // Grow the program as needed.
+    if (prog->length == prog->capacity) {
+        prog->capacity = (prog->capacity + 1) * 2;
+        prog->code = realloc(prog->code, prog->capacity * sizeof(instruction));
+    }
+    prog->code[prog->length++] = i;
+}
+
+program * compile(const unsigned char * p, const unsigned char * end) {
+    program * prog = newProgram();
+
+    while (p < end) {
+        instruction i;
+        int used = decode(p, end, &i);
+        if (used <= 0) {
+            if (used == 0) fprintf(stderr, "error: truncated instruction\n");
+            else fprintf(stderr, "error: unknown opcode\n");
+            freeProgram(prog);
+            return NULL;
+        }
+        append(prog, i); p += used;
+    }
+    return prog;
+}
+
+void freeProgram(program * prog) {
+    free(prog->code);
+    free(prog);
+}
+
+/*
+ * Sidecar files hold the magic string and version, the size and modification
+ * time of the source they were made from, the number of instructions and of
+ * long operands, then the packed instructions and the long operands, all as
+ * little-endian integers.  They are run where they lie, rather than unpacked.
+ *****************************************************/
+
+unsigned char * packProgram(program * prog, struct stat * info, size_t * n) {
+    size_t length = prog->length, longs = 0;
+    for (size_t j = 0; j < length; j++) longs += !fits(prog->code[j].operand);
+    *n = HEADER + 4 * (length + longs);
+    unsigned char * bytes = malloc(*n);
+    memcpy(bytes, MAGIC, 3); put(bytes + 3, VERSION, 1);
+    put(bytes + 4, (uint64_t) info->st_size, 8);
+    put(bytes + 12, (uint64_t) info->st_mtime, 8);
+    put(bytes + 20, length, 4); put(bytes + 24, longs, 4);
+
+    unsigned char * words = bytes + HEADER, * table = words + 4 * length;
+    size_t k = 0;
+    for (size_t j = 0; j < length; j++) {
+        instruction i = prog->code[j];
+        uint32_t word = (uint32_t) i.opcode;
+        if (fits(i.operand)) word |= (uint32_t) i.operand << PACK_SHIFT;
+        else {
+            word |= PACK_LONG | (uint32_t) k << PACK_SHIFT;
+            put(table + 4 * k++, (uint32_t) i.operand, 4);
+        }
+        put(words + 4 * j, word, 4);
+    }
+    return bytes;
+}
+
+bool openPacked(const unsigned char * bytes, size_t n, struct stat * info,
+                packed * prog) {
+    // Check that the sidecar is current before trusting its contents, and
+    // that the counts account for exactly the rest of it.
+    bool ok = n >= HEADER && memcmp(bytes, MAGIC, 3) == 0;
+    ok = ok && get(bytes + 3, 1) == (uint64_t) VERSION;
+    ok = ok && get(bytes + 4, 8) == (uint64_t) info->st_size;
+    ok = ok && get(bytes + 12, 8) == (uint64_t) info->st_mtime;
+    uint64_t length = ok ? get(bytes + 20, 4) : 0;
+    uint64_t longs = ok ? get(bytes + 24, 4) : 0;
+    ok = ok && length <= INT_MAX && longs <= length;
+    ok = ok && n - HEADER == 4 * (length + longs);
+    if (!ok) return false;
+    *prog = (packed) { (int) length, (int) longs, bytes + HEADER,
+                       bytes + HEADER + 4 * length };
+
+    // Check every opcode and long operand in one pass, so that running the
+    // program needs no checks.  The pass has no branches, so it vectorizes.
+    unsigned bad = 0, limit = (unsigned) longs;
+    for (int j = 0; j < prog->length; j++) {
+        const unsigned char * p = prog->words + 4 * (size_t) j;
+        uint32_t word = (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+                        (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+        bad |= (word & (PACK_LONG - 1)) > NX;
+        bad |= (word >> PACK_OPBITS & 1) & (word >> PACK_SHIFT >= limit);
+    }
+    return bad == 0;
+}
+
+int skipPackedBlock(const packed * prog, int j) {
+    int depth = 1;
+    for (; j < prog->length; j++) {
+        int opcode = unpack(prog, j).opcode;
+        if (opcode == LP) depth++;
+        else if (opcode == NX && --depth == 0) return j + 1;
+    }
+    return -1;
+}
+
+/*****************************************************/
+
+static int bytes_to_int(int n, const unsigned char bytes[4]) {
+    if (n == 0) {
+        return 0;
+    } else if (n == 1) {
+        return (int) bytes[0];
+    } else if (n == 2) {
+        uint32_t operand = 0;
+        operand |= ((uint32_t) bytes[0]) << 8;
+        operand |= (uint32_t) bytes[1];
+        if (operand >> 15 == 1) {
+            operand = ~operand ^ 0xFFFF;
+        }
+        return operand;
+    } else if (n == 3 || n == 4) {
+        uint32_t operand = 0;
+        operand |= ((uint32_t) bytes[0]) << 24;
+        operand |= ((uint32_t) bytes[1]) << 16;
+        operand |= ((uint32_t) bytes[2]) << 8;
+        operand |= (uint32_t) bytes[3];
+        if (operand >> 31 == 1) {
+            operand = ~operand ^ 0xFFFFFFFF;
+        }
+        return operand;
+    } else {
+        fprintf(stderr, "error: impossible n value [%d]\n", n);
+        exit(1);
+    }
+}
+
+// Check whether an operand fits in a packed instruction.
+static bool fits(int32_t operand) {
+    int32_t limit = 1 << (31 - PACK_SHIFT);
+    return operand >= -limit && operand < limit;
+}
+
+// Write the low n bytes of a value, least significant first.
+static void put(unsigned char * p, uint64_t value, int n) {
+    for (int i = 0; i < n; i++) p[i] = (unsigned char) (value >> (8 * i));
+}
+
+// Read an n byte value, least significant first.
+static uint64_t get(const unsigned char * p, int n) {
+    uint64_t value = 0;
+    for (int i = 0; i < n; i++) value |= (uint64_t) p[i] << (8 * i);
+    return value;
+}
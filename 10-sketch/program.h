@@ -0,0 +1,122 @@
+/* The program module decodes sketch bytecode into a compact array of
+fixed-width instructions.  Executing the array avoids re-parsing the packed
+opcode and operand bytes, and the array can be packed into a versioned
+sidecar file next to the source, which is run where it lies, so that a sketch
+which is replayed many times only pays the decoding cost once.
+*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Define opcode constants.
+enum {
+    DX = 0, // Change x position.
+    DY = 1, // Change y position.
+    DT = 2, // Pause instruction.
+    PN = 3, // Toggle pen states. // Also used as extension opcode.
+    CL = 4, // Clear the display.
+    KY = 5, // Wait for key down.
+    HU = 6, // Change draw color.
+    LP = 7, // Repeat the instructions up to the matching NX, operand times.
+    NX = 8  // End a repeat block.
+};
+
+// The deepest that repeat blocks can be nested.
+enum { LOOPS = 16 };
+
+// The mnemonic for each opcode, as used by the assembler.
+extern const char * const mnemonics[];
+
+// A decoded instruction.  Operands are sign-extended, and the operand of HU is
+// the packed rgba colour.
+struct instruction { int32_t opcode; int32_t operand; };
+typedef struct instruction instruction;
+
+// A decoded program, as an array of instructions.
+struct program { int length, capacity; instruction *code; };
+typedef struct program program;
+
+// A program packed as in a sidecar file, which can be run where it lies, such
+// as in a mapped file.  Each instruction is a little-endian word, with the
+// opcode in the low PACK_OPBITS bits, then a flag for a long operand, and then
+// the operand, if it fits in the remaining bits, or otherwise the index of the
+// long operand in a table after the words.
+struct packed { int length, longs; const unsigned char *words, *table; };
+typedef struct packed packed;
+enum { PACK_OPBITS = 4, PACK_LONG = 1 << PACK_OPBITS };
+enum { PACK_SHIFT = PACK_OPBITS + 1 };
+
+// An entry in the decoding table describes every instruction starting with a
+// given byte: its opcode (-1 if unknown), its sign-extended operand if it is a
+// single-byte instruction, and the number of operand bytes that follow.
+struct entry { int8_t opcode; int8_t operand; uint8_t extra; };
+typedef struct entry entry;
+
+// The decoding table, indexed by the first byte of an instruction.
+extern const entry decoding[256];
+
+// Find the total length in bytes of the instruction starting with this byte.
+int width(int byte);
+
+// Decode the instruction starting at p, without reading at or beyond end.
+// Return the number of bytes used, 0 if the instruction is truncated, or -1 if
+// its opcode is unknown.
+int decode(const unsigned char *p, const unsigned char *end, instruction *i);
+
+// Encode an instruction into bytes, using the shortest form which holds its
+// operand.  Return the number of bytes used, at most 5.
+int encode(instruction i, unsigned char bytes[5]);
+
+// Find the end of the repeat block whose body starts at p, just after its
+// matching NX, without reading at or beyond end.  Return NULL if the block
+// isn't closed, or can't be decoded.
+const unsigned char *skipBlock(const unsigned char *p,
+                               const unsigned char *end);
+
+// Find the end of the repeat block whose body starts at instruction j of a
+// program, just after its matching NX.  Return -1 if the block isn't closed.
+int skipBlockAt(program *prog, int j);
+
+// Create a new empty program.
+program *newProgram();
+
+// Add an instruction to the end of a program.
+void append(program *prog, instruction i);
+
+// Decode the bytes from p up to end into a new program, or return NULL after
+// reporting an error.
+program *compile(const unsigned char *p, const unsigned char *end);
+
+// Free a program.
+void freeProgram(program *prog);
+
+// Pack a program as a sidecar file for the source described by info, into a
+// new buffer of *n bytes.
+unsigned char *packProgram(program *prog, struct stat *info, size_t *n);
+
+// Check the n bytes of a sidecar file, and describe the program in it.  Return
+// false if it has the wrong version, was made from a different version of the
+// source described by info, or is cut off or corrupted.
+bool openPacked(const unsigned char *bytes, size_t n, struct stat *info,
+                packed *prog);
+
+// Unpack instruction j of a packed program.  This is defined here, so that
+// running a packed program costs no more than running a decoded one.
+static inline instruction unpack(const packed *prog, int j) {
+    const unsigned char *p = prog->words + 4 * (size_t) j;
+    uint32_t word = (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+                    (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+    uint32_t operand = word >> PACK_SHIFT;
+    if (word & PACK_LONG) {
+        p = prog->table + 4 * (size_t) operand;
+        operand = (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+                  (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+    } else if (operand >> (31 - PACK_SHIFT)) {
+        operand |= ~(uint32_t) 0 << (32 - PACK_SHIFT);
+    }
+    return (instruction) { word & (PACK_LONG - 1), (int32_t) operand };
+}
+
+// Find the end of the repeat block whose body starts at instruction j of a
+// packed program, just after its matching NX.  Return -1 if it isn't closed.
+int skipPackedBlock(const packed *prog, int j);
@@ -0,0 +1,292 @@
+/*
+ * render.c - drawing on a render thread, fed by a lock-free queue
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "backend.h"
+
+// The kinds of command, the capacity of the queue in commands, the number of
+// commands passed from one side to the other at a time, and the number of
+// times to yield before going to sleep while waiting.
+enum { OPEN, LINE, COLOUR, CLEAR, SHOW, SKIP, PAUSE, KEY, END, DISCARD };
+enum { QUEUE = 1 << 12, BATCH = 256, SPINS = 4 };
+
+// The two sides of the queue: the render thread and the caller.
+enum { DRAWER, CALLER };
+
+// Define a command, which is a display call and its arguments.
+struct command { int kind; int a[4]; };
+typedef struct command command;
+
+// Define a renderer.  The caller adds commands at the tail of the queue, and
+// the render thread carries them out on the inner display and then removes
+// them from the head, so the queue is empty once the last command is done.
+// Both positions only ever increase, and each is written by one side only, so
+// the queue needs no lock.  The lock and conditions are only used to sleep.
+// Each side moves its position on a batch at a time, rather than after every
+// command, so that the other side isn't woken for every line.  The caller
+// hands over what it has written at once before anything which waits, and at
+// show, so the drawing is never held back for long.
+struct renderer {
+    display base;
+    const backend * backend;   // Backend of the inner display.
+    char * title; int width, height;
+    display * inner;
+    command queue[QUEUE];
+    size_t head, tail;         // Accessed atomically.
+    size_t written;            // Commands written, up to tail once handed over.
+    char key;                  // Result of the last key command.
+    bool ended;                // Result of the end command.
+    int sleeping[2];           // Is each side asleep?  Accessed atomically.
+    pthread_mutex_t lock;
+    pthread_cond_t wake[2];
+    pthread_t thread;
+};
+typedef struct renderer renderer;
+
+// Declare function signatures.
+static void * render(void * arg);
+static bool carry(renderer * r, command * c);
+static const backend rendererBackend;
+
+// Check whether there are commands for the render thread, whether there is
+// room for another command, and whether all commands have been done.
+static bool pending(renderer * r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head;
+}
+
+static bool room(renderer * r) {
+    return r->written - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) < QUEUE;
+}
+
+static bool done(renderer * r) {
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == r->written;
+}
+
+// Wait on one side until a condition holds, yielding for a while and then
+// sleeping.  The sleeping flag is set before the condition is checked again,
+// and the other side changes the queue before checking the flag, so at least
+// one of them sees the other's change, and no wakeup is lost.
+static void await(renderer * r, int side, bool (*ready)(renderer * r)) {
+    for (int i = 0; !ready(r); i++) {
+        if (i < SPINS) { sched_yield(); continue; }
+        pthread_mutex_lock(&r->lock);
+        __atomic_store_n(&r->sleeping[side], 1, __ATOMIC_SEQ_CST);
+        while (!ready(r)) pthread_cond_wait(&r->wake[side], &r->lock);
+        __atomic_store_n(&r->sleeping[side], 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// Wake one side, if it is asleep.
+static void wake(renderer * r, int side) {
+    if (!__atomic_load_n(&r->sleeping[side], __ATOMIC_SEQ_CST)) return;
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_signal(&r->wake[side]);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Hand the commands written so far over to the render thread.
+static void publish(renderer * r) {
+    if (r->tail == r->written) return;
+    __atomic_store_n(&r->tail, r->written, __ATOMIC_SEQ_CST);
+    wake(r, DRAWER);
+}
+
+// Add a command to the queue, waiting if it is full, and hand over a batch
+// once there is one.
+static void push(renderer * r, command c) {
+    if (!room(r)) {
+        publish(r);
+        await(r, CALLER, room);
+    }
+    r->queue[r->written % QUEUE] = c;
+    r->written++;
+    if (r->written - r->tail >= BATCH) publish(r);
+}
+
+// Wait until every command added so far has been done.
+static void finish(renderer * r) {
+    publish(r);
+    await(r, CALLER, done);
+}
+
+// Add a command, and wait until it and all those before it have been done.
+static void barrier(renderer * r, command c) {
+    push(r, c);
+    finish(r);
+}
+
+display * openRenderer(const backend * b, char * title, int width, int height) {
+    renderer * r = malloc(sizeof(renderer));
+    r->base = (display) { .backend = &rendererBackend, .speed = 1 };
+    r->backend = b;
+    r->title = title; r->width = width; r->height = height;
+    r->inner = NULL;
+    r->ended = false;
+    r->head = r->tail = r->written = 0;
+    r->sleeping[DRAWER] = r->sleeping[CALLER] = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake[DRAWER], NULL);
+    pthread_cond_init(&r->wake[CALLER], NULL);
+
+    // Without a thread, draw directly instead.
+    if (pthread_create(&r->thread, NULL, render, r) != 0) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->wake[DRAWER]);
+        pthread_cond_destroy(&r->wake[CALLER]);
+        free(r);
+        return openBackend(b, title, width, height);
+    }
+
+    // Open the inner display on the render thread, so that a window belongs
+    // to the thread which draws on it.
+    barrier(r, (command) { OPEN });
+    return &r->base;
+}
+
+// Carry out commands until the end, handing back room in the queue a batch at
+// a time.  Before a pause, key wait or end, the inner display takes on the
+// speed and frame hook of the renderer, so the hook is called on this thread.
+static void * render(void * arg) {
+    renderer * r = arg;
+    bool ended = false;
+    while (!ended) {
+        await(r, DRAWER, pending);
+        size_t head = r->head;
+        size_t tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+        while (head != tail && !ended) {
+            ended = carry(r, &r->queue[head % QUEUE]);
+            head++;
+            if (head % BATCH == 0 || head == tail || ended) {
+                __atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+                wake(r, CALLER);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Carry out a command on the inner display.  Return true if it was the last.
+static bool carry(renderer * r, command * c) {
+    display * d = r->inner;
+    if (c->kind >= PAUSE) {
+        d->speed = r->base.speed;
+        d->hook = r->base.hook;
+        d->arg = r->base.arg;
+    }
+    int * a = c->a;
+    switch (c->kind) {
+        case OPEN:
+            r->inner = openBackend(r->backend, r->title, r->width, r->height);
+            break;
+        case LINE: line(d, a[0], a[1], a[2], a[3]); break;
+        case COLOUR: colour(d, a[0]); break;
+        case CLEAR: clear(d); break;
+        case SHOW: show(d); break;
+        case SKIP: skip(d, a[0], 0); break;
+        case PAUSE: pause(d, a[0]); break;
+        case KEY: r->key = key(d); break;
+        case END: r->ended = end(d); return true;
+        case DISCARD: discard(d); return true;
+    }
+    return false;
+}
+
+/*
+ * The renderer's display functions.
+ *****************************************************/
+
+static void renderLine(display * d, int x0, int y0, int x1, int y1) {
+    push((renderer *) d, (command) { LINE, { x0, y0, x1, y1 } });
+}
+
+static void renderColour(display * d, int rgba) {
+    push((renderer *) d, (command) { COLOUR, { rgba } });
+}
+
+static void renderClear(display * d) {
+    push((renderer *) d, (command) { CLEAR });
+}
+
+// Hand over the drawing so far straight away, so that it can be shown.
+static void renderShow(display * d) {
+    renderer * r = (renderer *) d;
+    push(r, (command) { SHOW });
+    publish(r);
+}
+
+// Pauses are carried out in turn on the render thread, so the caller needn't
+// wait for them, but the drawing before them is handed over straight away.
+static void renderPause(display * d, int ms) {
+    renderer * r = (renderer *) d;
+    push(r, (command) { PAUSE, { ms } });
+    publish(r);
+}
+
+// Skips are queued like pauses, so that the inner display's clock moves on
+// in turn, in steps that fit in a command.  Scripted keys are only used up
+// here, by the caller.
+static void renderSkip(display * d, long ms) {
+    renderer * r = (renderer *) d;
+    for (; ms > INT_MAX; ms -= INT_MAX) {
+        push(r, (command) { SKIP, { INT_MAX } });
+    }
+    push(r, (command) { SKIP, { (int) ms } });
+}
+
+static char renderKey(display * d) {
+    renderer * r = (renderer *) d;
+    barrier(r, (command) { KEY });
+    return r->key;
+}
+
+// Wait for the render thread to carry out a last command and stop, and return
+// the result of the end command, if that was it.
+static bool stop(renderer * r, command c) {
+    barrier(r, c);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake[DRAWER]);
+    pthread_cond_destroy(&r->wake[CALLER]);
+    bool ended = r->ended;
+    free(r);
+    return ended;
+}
+
+static bool renderEnd(display * d) {
+    return stop((renderer *) d, (command) { END });
+}
+
+static void renderDiscard(display * d) {
+    stop((renderer *) d, (command) { DISCARD });
+}
+
+// Pictures are taken once the drawing so far is done.
+static bool renderSnapshot(display * d, char * path) {
+    renderer * r = (renderer *) d;
+    finish(r);
+    return snapshot(r->inner, path);
+}
+
+static bool renderDigest(display * d, uint64_t * out) {
+    renderer * r = (renderer *) d;
+    finish(r);
+    return digest(r->inner, out);
+}
+
+static const backend rendererBackend = {
+    .name = "renderer", .line = renderLine, .colour = renderColour,
+    .pause = renderPause, .skip = renderSkip, .clear = renderClear,
+    .show = renderShow, .key = renderKey, .end = renderEnd,
+    .discard = renderDiscard, .snapshot = renderSnapshot,
+    .digest = renderDigest
+};
+
+/*****************************************************/
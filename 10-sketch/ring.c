@@ -0,0 +1,56 @@
+/*
+ * ring.c - ring buffers for streamed input
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+void clearRing(ring * r) {
+    r->head = 0; r->tail = 0;
+}
+
+size_t ringLength(ring * r) {
+    return r->tail - r->head;
+}
+
+long fillRing(ring * r, int fd) {
+    // Read into the free space after the tail, up to the end of the array.
+    size_t at = r->tail % RING;
+    size_t space = RING - ringLength(r);
+    if (space > RING - at) space = RING - at;
+    if (space == 0) return -1;
+
+    ssize_t n;
+    do { n = read(fd, &r->bytes[at], space); } while (n < 0 && errno == EINTR);
+    if (n > 0) r->tail += n;
+    return (long) n;
+}
+
+void peekRing(ring * r, unsigned char * out, size_t n) {
+    // Copy in up to two pieces, in case the bytes wrap around the array.
+    size_t at = r->head % RING;
+    size_t first = n < RING - at ? n : RING - at;
+    memcpy(out, &r->bytes[at], first);
+    memcpy(out + first, r->bytes, n - first);
+}
+
+void dropRing(ring * r, size_t n) {
+    r->head += n;
+}
+
+size_t pushRing(ring * r, const unsigned char * in, size_t n) {
+    // Copy in up to two pieces, in case the free space wraps around the array.
+    size_t space = RING - ringLength(r);
+    if (n > space) n = space;
+    size_t at = r->tail % RING;
+    size_t first = n < RING - at ? n : RING - at;
+    memcpy(&r->bytes[at], in, first);
+    memcpy(r->bytes, in + first, n - first);
+    r->tail += n;
+    return n;
+}
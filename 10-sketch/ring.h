@@ -0,0 +1,33 @@
+/* The ring module provides a fixed-size ring buffer of bytes, which is filled
+from a file descriptor as data arrives and drained from the other end.  It lets
+a decoder work on a stream, such as a pipe, without waiting for the stream to
+end, and without losing instructions which straddle two reads.
+*/
+#include <stddef.h>
+
+// The capacity of a ring buffer, in bytes.
+enum { RING = 1 << 16 };
+
+// A ring buffer holds the bytes from position head up to tail, where both
+// positions only ever increase, and wrap around the array.
+struct ring { unsigned char bytes[RING]; size_t head, tail; };
+typedef struct ring ring;
+
+// Make a ring buffer empty.
+void clearRing(ring *r);
+
+// Find the number of bytes held.
+size_t ringLength(ring *r);
+
+// Wait for bytes to arrive on file descriptor fd, and add as many as fit.
+// Return the number added, 0 at the end of the stream, or -1 on error.
+long fillRing(ring *r, int fd);
+
+// Copy n held bytes, starting from the head, without removing them.
+void peekRing(ring *r, unsigned char *out, size_t n);
+
+// Remove n held bytes from the head.
+void dropRing(ring *r, size_t n);
+
+// Add up to n bytes to the tail, as many as fit.  Return the number added.
+size_t pushRing(ring *r, const unsigned char *in, size_t n);
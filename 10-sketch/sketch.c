@@ -2,209 +2,450 @@
  * sketch.c - simple graphics engine
  */
 
-#include <assert.h>
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "display.h"
-
-// Define global opcode constants.
-const int DX = 0; // Change x position.
-const int DY = 1; // Change y position.
-const int DT = 2; // Pause instruction.
-const int PN = 3; // Toggle pen states. // Also used as extension opcode.
-const int CL = 4; // Clear the display.
-const int KY = 5; // Wait for key down.
-const int HU = 6; // Change draw color.
-
-// Define a structure for the current state.
-struct state {
-    int sx; // Stored x-coordinate of cursor.
-    int sy; // Stored y-coordinate of cursor.
+#include "batch.h"
+#include "vm.h"
 
-    int cx; // Current x-coordinate of cursor.
-    int cy; // Current y-coordinate of cursor.
+// Define a structure for a line of a digest manifest, which holds the digest of
+// one frame of a sketch.
+struct golden {
+    char * path; // Path of the sketch.
+    int frame;   // Number of the frame, counting from 1.
+    long ms;     // Virtual time of the frame.
+    uint64_t digest;
+};
+typedef struct golden golden;
 
-    bool PD; // Is the pen down?
+// Define a structure for saving or checking the frames of one run.
+struct frames {
+    char * path;      // Path of the sketch.
+    char * base;      // Path of the sketch without its extension.
+    int n;            // Number of frames seen so far.
+    golden ** expect; // Manifest entries for the sketch, by frame number - 1.
+    int expected;     // Number of frames in the manifest.
+    bool ok;          // Have the frames matched the manifest so far?
 };
-typedef struct state state;
+typedef struct frames frames;
 
-// Define global objects.
-FILE * input;
-display * D;
-state * S;
+// Define global options.
+bool cache = false;   // Use sidecar files of programs and keyframes.
+double factor = 1;    // Playback speed.
+bool capture = false; // Save a picture at every frame.
+long seek_to = -1;    // Instruction to start from, if any.
+long seek_time = -1;  // Virtual time to start from, if any.
+int view[4] = { 0, 0, 200, 200 }; // Part of the sketch to display: x, y, w, h.
+int profiling = 0;    // Report statistics: 0 for none, 1 as a table, 2 as JSON.
+int digests = 0;      // Digest frames: 0 not at all, 1 to print, 2 to check.
+golden * manifest;    // Digests to check against, if any.
+int goldens = 0;
 
 // Declare function signatures.
-void dx(int operand);
-void dy(int operand);
-void dt(int operand);
-void pn(); void cl(); void ky();
-void hu(unsigned char operands[4]);
-int bytes_to_int(int n, unsigned char bytes[4]);
+bool run_file(char * path);
+bool run_stream(sketch_vm * vm, FILE * input);
+bool run_cached(sketch_vm * vm, char * path, struct stat * info,
+                const unsigned char * p, const unsigned char * end);
+bool run_seek(sketch_vm * vm, char * path, struct stat * info,
+              const unsigned char * p, const unsigned char * end);
+char ** read_paths(FILE * in, int * n);
+bool read_manifest(char * path);
+bool read_keys(char * path);
+void on_frame(display * d, long ms, void * arg);
+void find_frames(frames * f);
 
 int main(int argc, char * argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: ./sketch [/path/to/file.sketch]\n");
-        return 1;
+    const char * usage =
+        "Usage: ./sketch [options] [/path/to/file.sketch | -]\n"
+        "       ./sketch [options] --batch [-j threads] [files...]\n"
+        "Options: --cache, --speed factor, --no-delay, --frames,\n"
+        "         --seek instruction, --from-time ms,\n"
+        "         --viewport x,y,w,h, --full-extent, --stats[=json],\n"
+        "         --digests, --check-digests manifest, --backend name,\n"
+        "         --render-thread, --keys script\n";
+
+    // Parse the options.
+    bool batch = false; int threads = cores(), i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--cache") == 0) {
+            cache = true;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            factor = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--no-delay") == 0) {
+            factor = 0;
+        } else if (strcmp(argv[i], "--frames") == 0) {
+            capture = true;
+        } else if (strcmp(argv[i], "--seek") == 0 && i + 1 < argc) {
+            seek_to = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--from-time") == 0 && i + 1 < argc) {
+            seek_time = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--viewport") == 0 && i + 1 < argc) {
+            int * v = view;
+            int n = sscanf(argv[++i], "%d,%d,%d,%d",
+                           &v[0], &v[1], &v[2], &v[3]);
+            if (n != 4 || v[2] <= 0 || v[3] <= 0) {
+                fprintf(stderr, "%s", usage);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--full-extent") == 0) {
+            view[2] = 0; view[3] = 0;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            profiling = 1;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            profiling = 2;
+        } else if (strcmp(argv[i], "--digests") == 0) {
+            digests = 1;
+        } else if (strcmp(argv[i], "--check-digests") == 0 && i + 1 < argc) {
+            digests = 2;
+            if (!read_manifest(argv[++i])) return 1;
+        } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            if (!read_keys(argv[++i])) return 1;
+        } else if (strcmp(argv[i], "--render-thread") == 0) {
+            useRenderThread(true);
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            if (!useBackend(argv[++i])) {
+                fprintf(stderr, "Unknown backend %s, expecting one of:",
+                        argv[i]);
+                for (int b = 0; backendName(b) != NULL; b++) {
+                    fprintf(stderr, " %s", backendName(b));
+                }
+                fprintf(stderr, "\n");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
     }
 
-    // Open the file for reading.
-    FILE * input = fopen(argv[1], "rb"); if (!input) {
-        fprintf(stderr, "error: %s\n", strerror(errno));
+    // Settle the backend before any worker opens a display, and check that the
+    // options suit it.  SDL windows can only be used from one thread, so
+    // batches need a headless backend, and the video backend streams to
+    // stdout, so nothing else can be printed there.
+    char * name = chosenBackend();
+    if (batch && strcmp(name, "sdl") == 0) {
+        fprintf(stderr, "error: --batch needs a headless backend, not sdl\n");
+        return 1;
+    }
+    if (strcmp(name, "video") == 0 && (batch || capture || digests)) {
+        fprintf(stderr, "error: the video backend writes to stdout, so it "
+                "can't be used with --batch, --frames or --digests\n");
         return 1;
     }
 
-    // Initialise a state instance.
-    S = (state *) malloc(sizeof(state));
-    S->sx = 0; S->sy = 0; S->cx = 0; S->cy = 0; S->PD = false;
+    if (!batch) {
+        if (argc - i != 1) {
+            fprintf(stderr, "%s", usage);
+            return 1;
+        }
+        return run_file(argv[i]) ? 0 : 1;
+    }
 
-    // Initialise a new graphical display.
-    D = newDisplay(argv[1], 200, 200);
+    // Render every file named on the command line, or listed on stdin.
+    int n = argc - i;
+    char ** paths = &argv[i];
+    if (n == 0) paths = read_paths(stdin, &n);
+    return runBatch(run_file, paths, n, threads) ? 0 : 1;
+}
 
-    // Read the file a single byte at a time.
-    int byte; while ((byte = getc(input)) != EOF) {
-        // Check validity of input.
-        int opcode = byte >> 6;
-        int operand = byte & ~(0x3 << 6);
+// Run one sketch file on its own display.  A path of - means stdin.
+bool run_file(char * path) {
+    // Open the file for reading.
+    bool piped = strcmp(path, "-") == 0;
+    FILE * input = piped ? stdin : fopen(path, "rb"); struct stat info;
+    if (!input || fstat(fileno(input), &info) < 0) {
+        fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+        if (input) fclose(input);
+        return false;
+    }
+    if (piped) path = "stdin";
 
-        // Handle each opcode case.
-        if (opcode == PN) {
-            // Extension parsing triggered; compute new opcode.
-            opcode = operand & ~(0xF << 4);
+    // Initialise an interpreter on a new graphical display.
+    display * d = newDisplay(path, view[2], view[3]);
+    speed(d, factor);
+    sketch_vm * vm = vm_new(d);
+    vm_view(vm, view[0], view[1], view[2], view[3]);
+    stats counters;
+    if (profiling) { startStats(&counters); vm_stats(vm, &counters); }
 
-            // Compute new operand bytes.
-            unsigned char operand_bytes[4] = {0};
-            int n = (operand >> 4) & 0x3;
-            if (n == 3) { n = 4; }
-            if (n != 0) {
-                for (int i = 0; i < n; i++) {
-                    operand_bytes[i] = getc(input);
-                }
-            }
-            operand = bytes_to_int(n, operand_bytes);
-
-            // Handle each embedded opcode case.
-            if (opcode == DX) {
-                // If negative, compute the two's complement.
-                dx(operand);
-            } else if (opcode == DY) {
-                dy(operand);
-            } else if (opcode == DT) {
-                dt(operand);
-            } else if (opcode == PN) {
-                pn();
-            } else if (opcode == CL) {
-                cl();
-            } else if (opcode == KY) {
-                ky();
-            } else if (opcode == HU) {
-                hu(operand_bytes);
-            } else {
-                fprintf(stderr, "error: unknown opcode\n");
-                return 1;
-            }
-        } else if (opcode == DX) {
-            if (operand >> 5 == 1) {
-                dx((int)(~operand ^ 0x3F));
-            } else {
-                dx(operand);
-            }
-        } else if (opcode == DY) {
-            if (operand >> 5 == 1) {
-                dy((int)(~operand ^ 0x3F));
+    // Save each frame as base-0001.ppm, base-0002.ppm and so on, and digest
+    // each frame if asked to.
+    frames f = { .path = path, .base = strdup(path), .n = 0, .ok = true };
+    char * dot = strrchr(f.base, '.');
+    if (dot != NULL && strcmp(dot, ".sketch") == 0) *dot = '\0';
+    if (digests == 2) find_frames(&f);
+    if (capture || digests) onFrame(d, on_frame, &f);
+
+    // Map regular files into memory and walk them directly; anything else,
+    // such as a pipe, is decoded as it arrives.
+    bool ok = true;
+    if (S_ISREG(info.st_mode)) {
+        size_t size = (size_t) info.st_size;
+        void * map = NULL;
+        if (size > 0) {
+            int fd = fileno(input);
+            map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+                ok = false; map = NULL;
             } else {
-                dy(operand);
+                posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
             }
-        } else if (opcode == DT) {
-            dt(operand);
-        } else {
-            fprintf(stderr, "error: unknown opcode\n");
-            return 1;
         }
+        const unsigned char * start = map, * end = start + size;
+        bool seek = seek_to >= 0 || seek_time >= 0;
+        if (ok && seek) ok = run_seek(vm, path, &info, start, end);
+        else if (ok && cache) ok = run_cached(vm, path, &info, start, end);
+        else if (ok) ok = vm_run_bytes(vm, start, end);
+        if (map != NULL) munmap(map, size);
+    } else if (seek_to >= 0 || seek_time >= 0) {
+        fprintf(stderr, "error: %s: can't seek in a stream\n", path);
+        ok = false;
+    } else {
+        ok = run_stream(vm, input);
     }
 
     // Close the file descriptor.
     fclose(input);
 
-    // End it all.
-    end(D);
+    // End it all, or if the run failed, shut the display down at once.
+    double t = clockSeconds();
+    if (ok) {
+        ok = end(d);
+        if (profiling) countCall(&counters, ON_END, t);
+    } else {
+        discard(d);
+    }
+    if (profiling) printStats(&counters, path, stderr, profiling == 2);
+    if (ok && digests == 2 && f.ok && f.n != f.expected) {
+        fprintf(stderr, "%s: %d frames, expecting %d\n", path, f.n, f.expected);
+        f.ok = false;
+    } else if (ok && digests == 2 && f.ok) {
+        printf("Digests %s OK (%d frames)\n", path, f.n);
+    }
+    vm_free(vm);
+    free(f.base);
+    free(f.expect);
+    ok = ok && f.ok;
+    return ok;
 }
 
-/*
- * Functions that directly execute given instructions.
- *****************************************************/
+// Feed a program to the interpreter from a stream as it arrives, showing what
+// has been drawn after each read, so that a line appears as soon as its bytes
+// do.
+bool run_stream(sketch_vm * vm, FILE * input) {
+    long got; bool ok = true;
+    while (ok && (got = vm_read(vm, fileno(input))) > 0) ok = vm_run(vm);
 
-void dx(int operand) {
-    S->cx += operand;
+    if (ok && got < 0) {
+        fprintf(stderr, "error: %s\n", strerror(errno));
+        ok = false;
+    }
+    return ok && vm_finish(vm);
 }
 
-void dy(int operand) {
-    S->cy += operand;
-    if (S->PD) {
-        line(D, S->sx, S->sy, S->cx, S->cy);
+// Run a program from its sidecar file ("file.sketchc" next to "file.sketch"),
+// mapped into memory and run where it lies.  If the sidecar is missing or out
+// of date, compile and pack the program, write it as the sidecar, and run it
+// from memory.
+bool run_cached(sketch_vm * vm, char * path, struct stat * info,
+                const unsigned char * p, const unsigned char * end) {
+    char sidecar[strlen(path) + 2];
+    sprintf(sidecar, "%sc", path);
+
+    packed prog; size_t size = 0;
+    FILE * in = fopen(sidecar, "rb");
+    struct stat about;
+    void * map = NULL;
+    if (in != NULL && fstat(fileno(in), &about) == 0 && about.st_size > 0) {
+        size = (size_t) about.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+        if (map == MAP_FAILED) map = NULL;
+        else posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
     }
-    S->sx = S->cx; S->sy = S->cy;
-}
+    if (in != NULL) fclose(in);
+    if (map != NULL && openPacked(map, size, info, &prog)) {
+        bool ok = vm_run_packed(vm, &prog);
+        munmap(map, size);
+        return ok;
+    }
+    if (map != NULL) munmap(map, size);
 
-void dt(int operand) {
-    pause(D, operand * 10);
+    program * compiled = compile(p, end);
+    if (compiled == NULL) return false;
+    unsigned char * bytes = packProgram(compiled, info, &size);
+    freeProgram(compiled);
+    FILE * out = fopen(sidecar, "wb");
+    bool saved = out != NULL && fwrite(bytes, 1, size, out) == size;
+    if (out != NULL && fclose(out) != 0) saved = false;
+    if (!saved) fprintf(stderr, "warning: can't write %s\n", sidecar);
+    openPacked(bytes, size, info, &prog);
+    bool ok = vm_run_packed(vm, &prog);
+    free(bytes);
+    return ok;
 }
 
-void pn() {
-    S->PD = !S->PD;
+// Seek in a program.  With --cache, the seek starts from the nearest keyframe
+// in an index kept as a sidecar file ("file.sketchi" next to "file.sketch"),
+// which is read in one go, and written back if the seek adds to it.
+bool run_seek(sketch_vm * vm, char * path, struct stat * info,
+              const unsigned char * p, const unsigned char * end) {
+    if (!cache) return vm_seek(vm, p, end, seek_to, seek_time, NULL);
+    char sidecar[strlen(path) + 2];
+    sprintf(sidecar, "%si", path);
+
+    unsigned char * bytes = NULL; size_t size = 0;
+    FILE * in = fopen(sidecar, "rb");
+    struct stat about;
+    if (in != NULL && fstat(fileno(in), &about) == 0 && about.st_size > 0) {
+        size = (size_t) about.st_size;
+        bytes = malloc(size);
+        if (fread(bytes, 1, size, in) != size) { free(bytes); bytes = NULL; }
+    }
+    if (in != NULL) fclose(in);
+    keyframes * index = vm_index(bytes, size, info);
+    free(bytes);
+
+    bool ok = vm_seek(vm, p, end, seek_to, seek_time, index);
+    bytes = vm_pack_index(index, info, &size);
+    if (bytes != NULL) {
+        FILE * out = fopen(sidecar, "wb");
+        bool saved = out != NULL && fwrite(bytes, 1, size, out) == size;
+        if (out != NULL && fclose(out) != 0) saved = false;
+        if (!saved) fprintf(stderr, "warning: can't write %s\n", sidecar);
+        free(bytes);
+    }
+    vm_free_index(index);
+    return ok;
 }
 
-void cl() {
-    clear(D);
+// Read a list of paths, one per line.
+char ** read_paths(FILE * in, int * n) {
+    char ** paths = NULL; int capacity = 0; *n = 0;
+    char * line = NULL; size_t size = 0; ssize_t length;
+    while ((length = getline(&line, &size, in)) > 0) {
+        if (line[length - 1] == '\n') line[--length] = '\0';
+        if (length == 0) continue;
+        if (*n == capacity) {
+            capacity = (capacity + 1) * 2;
+            paths = realloc(paths, capacity * sizeof(char *));
+        }
+        paths[(*n)++] = strdup(line);
+    }
+    free(line);
+    return paths;
 }
 
-void ky() {
-    key(D);
+// Read a manifest of frame digests, as written by --digests.
+bool read_manifest(char * path) {
+    FILE * in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    char * line = NULL; size_t size = 0; int capacity = 0;
+    while (getline(&line, &size, in) > 0) {
+        golden g; char name[size];
+        if (sscanf(line, "%s %d %ld %" SCNx64, name, &g.frame, &g.ms,
+                   &g.digest) != 4) continue;
+        if (g.frame < 1) {
+            fprintf(stderr, "error: %s: bad frame number %d\n", path, g.frame);
+            free(line); fclose(in);
+            return false;
+        }
+        g.path = strdup(name);
+        if (goldens == capacity) {
+            capacity = (capacity + 1) * 2;
+            manifest = realloc(manifest, capacity * sizeof(golden));
+        }
+        manifest[goldens++] = g;
+    }
+    free(line);
+    fclose(in);
+    return true;
 }
 
-void hu(unsigned char operands[4]) {
-    // Pack the colour into an integer.
-    int rgba = 0;
-    rgba |= ((int) operands[0]) << 24;
-    rgba |= ((int) operands[1]) << 16;
-    rgba |= ((int) operands[2]) << 8;
-    rgba |= (int) operands[3];
+// Read a key script, with a line for each key press giving the virtual time in
+// milliseconds and the key, such as "1500 q".  Other lines are ignored.
+bool read_keys(char * path) {
+    FILE * in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "error: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    long * times = NULL; char * keys = NULL; int n = 0, capacity = 0;
+    char * line = NULL; size_t size = 0;
+    while (getline(&line, &size, in) > 0) {
+        long ms; char k;
+        if (sscanf(line, "%ld %c", &ms, &k) != 2) continue;
+        if (n == capacity) {
+            capacity = (capacity + 1) * 2;
+            times = realloc(times, capacity * sizeof(long));
+            keys = realloc(keys, capacity);
+        }
+        times[n] = ms; keys[n] = k; n++;
+    }
+    free(line);
+    fclose(in);
+    typeKeys(n, times, keys);
+    return true;
+}
 
-    // Execute the instruction.
-    colour(D, rgba);
+// Find the manifest entries for a run, in order of frame number.
+void find_frames(frames * f) {
+    f->expected = 0;
+    for (int j = 0; j < goldens; j++) {
+        if (strcmp(manifest[j].path, f->path) != 0) continue;
+        if (manifest[j].frame > f->expected) f->expected = manifest[j].frame;
+    }
+    f->expect = calloc(f->expected + 1, sizeof(golden *));
+    for (int j = 0; j < goldens; j++) {
+        if (strcmp(manifest[j].path, f->path) != 0) continue;
+        f->expect[manifest[j].frame - 1] = &manifest[j];
+    }
 }
 
-/*****************************************************/
-
-int bytes_to_int(int n, unsigned char bytes[4]) {
-    if (n == 0) {
-        return 0;
-    } else if (n == 1) {
-        return (int) bytes[0];
-    } else if (n == 2) {
-        uint32_t operand = 0;
-        operand |= ((uint32_t) bytes[0]) << 8;
-        operand |= (uint32_t) bytes[1];
-        if (operand >> 15 == 1) {
-            operand = ~operand ^ 0xFFFF;
-        }
-        return operand;
-    } else if (n == 3 || n == 4) {
-        uint32_t operand = 0;
-        operand |= ((uint32_t) bytes[0]) << 24;
-        operand |= ((uint32_t) bytes[1]) << 16;
-        operand |= ((uint32_t) bytes[2]) << 8;
-        operand |= (uint32_t) bytes[3];
-        if (operand >> 31 == 1) {
-            operand = ~operand ^ 0xFFFFFFFF;
-        }
-        return operand;
-    } else {
-        fprintf(stderr, "error: impossible n value [%d]\n", n);
-        exit(1);
+// Handle a frame: save it, log its name and virtual time, print its digest, or
+// check its digest against the manifest, as asked.  Only the first frame which
+// doesn't match is reported.
+void on_frame(display * d, long ms, void * arg) {
+    frames * f = arg;
+    f->n++;
+    if (capture) {
+        char path[strlen(f->base) + 20];
+        sprintf(path, "%s-%04d.ppm", f->base, f->n);
+        if (snapshot(d, path)) printf("%s %ld\n", path, ms);
+    }
+
+    uint64_t hash;
+    if (digests == 0 || !f->ok) return;
+    if (!digest(d, &hash)) {
+        fprintf(stderr, "%s: frame %d has no digest\n", f->path, f->n);
+        f->ok = false;
+    } else if (digests == 1) {
+        printf("%s %d %ld %016" PRIx64 "\n", f->path, f->n, ms, hash);
+    } else if (f->n > f->expected || f->expect[f->n - 1] == NULL) {
+        fprintf(stderr, "%s: frame %d at %ld ms isn't in the manifest\n",
+                f->path, f->n, ms);
+        f->ok = false;
+    } else if (f->expect[f->n - 1]->digest != hash) {
+        golden * g = f->expect[f->n - 1];
+        fprintf(stderr, "%s: frame %d at %ld ms has digest %016" PRIx64
+                ", expecting %016" PRIx64 " at %ld ms\n",
+                f->path, f->n, ms, hash, g->digest, g->ms);
+        f->ok = false;
     }
 }
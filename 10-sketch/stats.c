@@ -0,0 +1,136 @@
+/*
+ * stats.c - profiling counters for the interpreter
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "program.h"
+#include "stats.h"
+
+// The name of each kind of display call, and of each encoding.
+static const char * const calls[] = {
+    "line", "colour", "pause", "clear", "show", "key", "end"
+};
+static const char * const forms[] = { "short", "ext0", "ext1", "ext2", "ext4" };
+
+// Declare function signatures.
+static void printTable(stats * s, char * title, FILE * out, double total);
+static void printJSON(stats * s, char * title, FILE * out, double total);
+
+double clockSeconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void startStats(stats * s) {
+    memset(s, 0, sizeof(stats));
+    s->start = clockSeconds();
+}
+
+int form(int byte) {
+    if (byte >> 6 != PN) return SHORT;
+    return EXT0 + ((byte >> 4) & 3);
+}
+
+void countLine(stats * s, int x0, int y0, int x1, int y1) {
+    // A line covers one pixel per step along its longer direction.
+    long dx = labs((long) x1 - x0), dy = labs((long) y1 - y0);
+    long n = (dx > dy ? dx : dy) + 1;
+    s->pixels += n;
+    int k = 0;
+    while (n > 1) { n >>= 1; k++; }
+    s->lengths[k]++;
+}
+
+void countCall(stats * s, int call, double since) {
+    s->calls[call]++;
+    s->seconds[call] += clockSeconds() - since;
+}
+
+void printStats(stats * s, char * title, FILE * out, bool json) {
+    double total = clockSeconds() - s->start;
+
+    // Keep the report in one piece when several runs finish at once.
+    flockfile(out);
+    if (json) printJSON(s, title, out, total);
+    else printTable(s, title, out, total);
+    funlockfile(out);
+}
+
+static void printTable(stats * s, char * title, FILE * out, double total) {
+    fprintf(out, "%s: %.3f ms\n", title, total * 1e3);
+
+    fprintf(out, "  %-8s %12s\n", "opcode", "count");
+    for (int op = DX; op <= NX; op++) {
+        fprintf(out, "  %-8s %12ld\n", mnemonics[op], s->opcodes[op]);
+    }
+
+    fprintf(out, "  %-8s %12s\n", "encoding", "count");
+    for (int f = 0; f < FORMS; f++) {
+        fprintf(out, "  %-8s %12ld\n", forms[f], s->forms[f]);
+    }
+
+    double display = 0;
+    fprintf(out, "  %-8s %12s %12s\n", "call", "count", "ms");
+    for (int c = 0; c < CALLS; c++) {
+        fprintf(out, "  %-8s %12ld %12.3f\n", calls[c], s->calls[c],
+                s->seconds[c] * 1e3);
+        display += s->seconds[c];
+    }
+    fprintf(out, "  %-8s %12s %12.3f\n", "decode", "", (total - display) * 1e3);
+
+    fprintf(out, "  %-8s %12s\n", "clip", "lines");
+    fprintf(out, "  %-8s %12ld\n", "culled", s->culled);
+    fprintf(out, "  %-8s %12ld\n", "trimmed", s->trimmed);
+
+    fprintf(out, "  %-8s %12s   (%ld pixels)\n", "length", "lines", s->pixels);
+    for (int k = 0; k < BUCKETS; k++) {
+        if (s->lengths[k] == 0) continue;
+        fprintf(out, "  %-8ld %12ld\n", 1L << k, s->lengths[k]);
+    }
+}
+
+static void printJSON(stats * s, char * title, FILE * out, double total) {
+    // Quote the title, escaping anything JSON doesn't allow as it is.
+    fputs("{\"sketch\":\"", out);
+    for (char * p = title; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') fprintf(out, "\\%c", *p);
+        else if ((unsigned char) *p < 0x20) fprintf(out, "\\u%04x", *p);
+        else fputc(*p, out);
+    }
+    fprintf(out, "\",\"seconds\":%.6f", total);
+
+    fputs(",\"opcodes\":{", out);
+    for (int op = DX; op <= NX; op++) {
+        fprintf(out, "%s\"%s\":%ld", op > DX ? "," : "", mnemonics[op],
+                s->opcodes[op]);
+    }
+    fputs("},\"encodings\":{", out);
+    for (int f = 0; f < FORMS; f++) {
+        fprintf(out, "%s\"%s\":%ld", f > 0 ? "," : "", forms[f], s->forms[f]);
+    }
+
+    double display = 0;
+    fputs("},\"calls\":{", out);
+    for (int c = 0; c < CALLS; c++) {
+        fprintf(out, "%s\"%s\":{\"count\":%ld,\"seconds\":%.6f}",
+                c > 0 ? "," : "", calls[c], s->calls[c], s->seconds[c]);
+        display += s->seconds[c];
+    }
+    fprintf(out, "},\"decode_seconds\":%.6f", total - display);
+    fprintf(out, ",\"culled\":%ld,\"trimmed\":%ld", s->culled, s->trimmed);
+
+    fprintf(out, ",\"pixels\":%ld,\"lengths\":{", s->pixels);
+    bool first = true;
+    for (int k = 0; k < BUCKETS; k++) {
+        if (s->lengths[k] == 0) continue;
+        fprintf(out, "%s\"%ld\":%ld", first ? "" : ",", 1L << k, s->lengths[k]);
+        first = false;
+    }
+    fputs("}}\n", out);
+}
@@ -0,0 +1,51 @@
+/* The stats module keeps profiling counters for one run of the interpreter:
+how many instructions of each opcode and encoding were run, how many pixels
+the lines drawn cover and how long they are, how many lines were clipped, and
+how much time went on each kind of display call.  Whatever isn't spent in
+display calls went on decoding and dispatch.  Counters are only kept when asked
+for, so that runs without them cost nothing extra.
+*/
+#include <stdbool.h>
+#include <stdio.h>
+
+// The kinds of display call which are timed.
+enum { ON_LINE, ON_COLOUR, ON_PAUSE, ON_CLEAR, ON_SHOW, ON_KEY, ON_END, CALLS };
+
+// The encodings of an instruction: a short form, or an extension with 0, 1, 2
+// or 4 operand bytes.
+enum { SHORT, EXT0, EXT1, EXT2, EXT4, FORMS };
+
+// The number of buckets in the histogram of line lengths.
+enum { BUCKETS = 33 };
+
+// Profiling counters for one run.
+struct stats {
+    long opcodes[16];      // Instructions run, by opcode.
+    long forms[FORMS];     // Instructions run, by encoding, where known.
+    long pixels;           // Pixels covered by lines drawn, before clipping.
+    long lengths[BUCKETS]; // Lines of 2^k to 2^(k+1)-1 pixels, by k.
+    long culled;           // Lines not drawn, being wholly out of view.
+    long trimmed;          // Overlong lines cut to the part in view.
+    long calls[CALLS];     // Display calls, by kind.
+    double seconds[CALLS]; // Time in display calls, by kind.
+    double start;          // When the run started.
+};
+typedef struct stats stats;
+
+// Find the current time, in seconds from an arbitrary starting point.
+double clockSeconds();
+
+// Reset the counters, and note the time the run starts.
+void startStats(stats *s);
+
+// Find the encoding of an instruction from its first byte.
+int form(int byte);
+
+// Count a line from (x0,y0) to (x1,y1).
+void countLine(stats *s, int x0, int y0, int x1, int y1);
+
+// Count a display call of the given kind, which started at the given time.
+void countCall(stats *s, int call, double since);
+
+// Write a report for a run, as a table or as a line of JSON.
+void printStats(stats *s, char *title, FILE *out, bool json);
@@ -0,0 +1,44 @@
+/*
+ * strokes.c - time incremental drawing on a large display
+ *
+ * Draws many short strokes on a 2000x2000 display, showing the display after
+ * each one as a streamed sketch would, and reports the average time per
+ * stroke.  Link it with any implementation of the display module.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "display.h"
+
+// Read a monotonic clock in seconds.
+double seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char * argv[]) {
+    int size = 2000, strokes = argc > 1 ? atoi(argv[1]) : 2000;
+    display * d = newDisplay("strokes", size, size);
+
+    uint64_t seed = 0x5eed;
+    double start = seconds();
+    for (int i = 0; i < strokes; i++) {
+        // Use xorshift to place a random stroke of up to 20 pixels.
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        int x = seed % (size - 20), y = (seed >> 16) % (size - 20);
+        line(d, x, y, x + (seed >> 32) % 20, y + (seed >> 40) % 20);
+        show(d);
+    }
+    double taken = seconds() - start;
+
+    printf("%d strokes on %dx%d: %.3f ms per stroke\n",
+           strokes, size, size, taken / strokes * 1e3);
+    speed(d, 0);
+    end(d);
+}
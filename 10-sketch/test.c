@@ -1,68 +1,114 @@
-#include "display.h"
+#include "backend.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 // Display structure for testing, holding the filename, the expected calls, the
-// number of calls made, and the current actual call.
-struct display { char *file; char **calls; int n; char call[100]; };
+// number of calls made, the current actual call, and whether the test failed.
+struct tester {
+    display base; char *file; char **calls; int n; char call[100];
+    bool failed;
+};
+typedef struct tester tester;
 
 // Forward declarations of findTest and fail, which are at the end of this file.
 static char **findTest(char *file);
-static void fail(display *d, char *format);
+static void fail(tester *d, char *format);
 
-// Check an actual call against the next expected call.
-static void check(display *d) {
+// Check an actual call against the next expected call.  Once the test has
+// failed, calls are no longer checked.
+static void check(tester *d) {
+    if (d->failed) return;
     char *expect = d->calls[d->n];
     if (expect == NULL) fail(d, "Unexpected extra call %s\n");
-    if (strcmp(d->call, expect) != 0) fail(d, "Call %s\nExpecting %s\n");
-    d->n = d->n + 1;
+    else if (strcmp(d->call, expect) != 0) fail(d, "Call %s\nExpecting %s\n");
+    else d->n = d->n + 1;
 }
 
 // Create a dummy display object containing the expected calls for the file.
-display *newDisplay(char *file, int width, int height) {
-    display *d = malloc(sizeof(display));
-    *d = (struct display) { file, findTest(file), 0 };
-    return d;
+static display *testOpen(char *file, int width, int height) {
+    tester *d = malloc(sizeof(tester));
+    *d = (tester) { .file = file, .calls = findTest(file) };
+    d->failed = d->calls == NULL;
+    return &d->base;
 }
 
 // Check that this call to line(...) is the expected one.
-void line(display *d, int x0, int y0, int x1, int y1) {
+static void testLine(display *base, int x0, int y0, int x1, int y1) {
+    tester *d = (tester *) base;
     sprintf(d->call, "line(d,%d,%d,%d,%d)", x0, y0, x1, y1);
     check(d);
 }
 
 // Check that this call to pause(...) is the expected one.
-void pause(display *d, int ms) {
+static void testPause(display *base, int ms) {
+    tester *d = (tester *) base;
     sprintf(d->call, "pause(d,%d)", ms);
     check(d);
+    callHook(base);
 }
 
 // Check that this call to colour(...) is the expected one.
-void colour(display *d, int rgba) {
+static void testColour(display *base, int rgba) {
+    tester *d = (tester *) base;
     sprintf(d->call, "colour(d,0x%08x)", rgba);
     check(d);
 }
 
 // Check that this call to clear(...) is the expected one.
-void clear(display *d) {
+static void testClear(display *base) {
+    tester *d = (tester *) base;
     sprintf(d->call, "clear(d)");
     check(d);
 }
 
+// Calls to show(...) don't affect the drawing, so they aren't checked.
+static void testShow(display *d) {
+}
+
 // Check that this call to key(...) is the expected one.
-char key(display *d) {
+static char testKey(display *base) {
+    tester *d = (tester *) base;
     sprintf(d->call, "key(d)");
     check(d);
+    callHook(base);
     return '?';
 }
 
 // Check that this call to end(...) is the last expected call.
-void end(display *d) {
-    if (d->calls[d->n] != NULL) fail(d, "Expecting further call(s)\n");
-    printf("Sketch %s OK\n", d->file);
+static bool testEnd(display *base) {
+    tester *d = (tester *) base;
+    if (!d->failed && d->calls[d->n] != NULL) {
+        fail(d, "Expecting further call(s)\n");
+    }
+    callHook(base);
+    bool ok = !d->failed;
+    if (ok) printf("Sketch %s OK\n", d->file);
+    free(d);
+    return ok;
+}
+
+// A sketch which is rejected, part way through, shows as a call to error(),
+// which is checked like any other, and must be the last.  The run still fails,
+// so the sketch isn't reported as OK, only as rejected where it should be.
+static void testDiscard(display *base) {
+    tester *d = (tester *) base;
+    sprintf(d->call, "error()");
+    check(d);
+    if (!d->failed && d->calls[d->n] != NULL) {
+        fail(d, "Expecting further call(s)\n");
+    }
+    if (!d->failed) printf("Sketch %s rejected as expected\n", d->file);
+    free(d);
 }
 
+// There is no picture to save or digest.
+const backend testBackend = {
+    .name = "test", .open = testOpen, .line = testLine, .colour = testColour,
+    .pause = testPause, .clear = testClear, .show = testShow, .key = testKey,
+    .end = testEnd, .discard = testDiscard
+};
+
 // ------------ The test data --------------------------------------------------
 // Each test is a series of calls, stored in a variable-length array of strings,
 // with a NULL terminator.
@@ -78,7 +124,8 @@ static char *squareTest[] = {
     "line(d,60,60,30,60)","line(d,30,60,30,30)", NULL
 };
 
-// The calls that should be made for box.sketch.
+// The calls that should be made for box.sketch, and for boxloop.sketch, which
+// draws the same box using loops.
 static char *boxTest[] = {
     "line(d,30,30,32,30)", "pause(d,50)", "line(d,32,30,34,30)", "pause(d,50)",
     "line(d,34,30,36,30)", "pause(d,50)", "line(d,36,30,38,30)", "pause(d,50)",
@@ -165,13 +212,46 @@ static char *lawnTest[] = {
     NULL
 };
 
+// The calls that should be made for edge.sketch, whose last line is culled.
+static char *edgeTest[] = {
+    "line(d,-295,92,458,224)", "line(d,216,123,196,65)", NULL
+};
+
+// The calls that should be made for nested.sketch.
+static char *nestedTest[] = {
+    "line(d,30,30,35,30)", "pause(d,50)", "line(d,35,30,40,30)", "pause(d,50)",
+    "line(d,40,30,45,30)", "pause(d,50)", "line(d,45,30,50,30)", "pause(d,50)",
+    "line(d,30,40,35,40)", "pause(d,50)", "line(d,35,40,40,40)", "pause(d,50)",
+    "line(d,40,40,45,40)", "pause(d,50)", "line(d,45,40,50,40)", "pause(d,50)",
+    "line(d,30,50,35,50)", "pause(d,50)", "line(d,35,50,40,50)", "pause(d,50)",
+    "line(d,40,50,45,50)", "pause(d,50)", "line(d,45,50,50,50)", "pause(d,50)",
+    NULL
+};
+
+// The calls that should be made for zero.sketch, whose blocks repeat 0 and -1
+// times, so are skipped, along with the block nested in the first.
+static char *zeroTest[] = {
+    "line(d,30,30,60,30)", NULL
+};
+
+// The calls that should be made for unclosed.sketch, whose block has no end,
+// so it is run once and then the sketch is rejected.
+static char *unclosedTest[] = {
+    "line(d,30,30,60,30)", "error()", NULL
+};
+
 // Find the right test for the given sketch filename.
 static char **findTest(char *file) {
     if (strcmp(file, "line.sketch") == 0) return lineTest;
     if (strcmp(file, "square.sketch") == 0) return squareTest;
     if (strcmp(file, "box.sketch") == 0) return boxTest;
+    if (strcmp(file, "boxloop.sketch") == 0) return boxTest;
+    if (strcmp(file, "nested.sketch") == 0) return nestedTest;
+    if (strcmp(file, "zero.sketch") == 0) return zeroTest;
+    if (strcmp(file, "unclosed.sketch") == 0) return unclosedTest;
     if (strcmp(file, "oxo.sketch") == 0) return oxoTest;
     if (strcmp(file, "diag.sketch") == 0) return diagTest;
+    if (strcmp(file, "edge.sketch") == 0) return edgeTest;
     if (strcmp(file, "cross.sketch") == 0) return crossTest;
     if (strcmp(file, "clear.sketch") == 0) return clearTest;
     if (strcmp(file, "key.sketch") == 0) return keyTest;
@@ -179,13 +259,12 @@ static char **findTest(char *file) {
     if (strcmp(file, "field.sketch") == 0) return fieldTest;
     if (strcmp(file, "lawn.sketch") == 0) return lawnTest;
     fprintf(stderr, "Can't find test for %s\n", file);
-    exit(1);
     return NULL;
 }
 
-// Report failure and exit.
-static void fail(display *d, char *format) {
+// Report failure.
+static void fail(tester *d, char *format) {
     fprintf(stderr, "Failure in %s\n", d->file);
     fprintf(stderr, format, d->call, d->calls[d->n]);
-    exit(1);
+    d->failed = true;
 }
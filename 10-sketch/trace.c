@@ -0,0 +1,284 @@
+/* An implementation of the display module which records every call as a
+compact binary record, for regression testing of sketches too long to check by
+hand.  Each record is a one-byte kind followed by its arguments as 4-byte
+little-endian integers, and the trace ends with an end record.  A rolling
+FNV-1a hash of the records is kept as well, so that a sketch with millions of
+calls can be checked against just a count and a hash.
+
+By default, the calls are checked one by one against the golden trace for the
+sketch, in a .trace file next to it, or if there is none, against the count and
+hash in a .hash file.  Setting the environment variable SKETCH_TRACE to record
+writes a .trace file instead, and setting it to hash writes a .hash file. */
+
+#include "backend.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The kinds of record, and the number of arguments each has.
+enum { LINE, COLOUR, PAUSE, CLEAR, KEY, END };
+static const int arguments[] = { 4, 1, 1, 0, 0, 0 };
+
+// The modes of a trace display.
+enum { VERIFY, RECORD, HASH };
+
+// A record of a single call.
+struct record { int kind; int32_t a[4]; };
+typedef struct record record;
+
+// Display structure for tracing, holding the filename, the mode, the golden or
+// output file, the number of calls and their hash so far, and whether the trace
+// has failed.
+struct tracer {
+    display base; char *file; int mode; FILE *golden; char *path;
+    long n; uint64_t hash; uint64_t goldenHash; long goldenCount;
+    bool failed;
+};
+typedef struct tracer tracer;
+
+// Forward declarations of the helpers, which are at the end of this file.
+static void trace(tracer *d, record *r);
+static void check(tracer *d, record *r);
+static bool readRecord(FILE *in, record *r);
+static void writeRecord(FILE *out, record *r);
+static void describe(char *out, record *r);
+static void fail(tracer *d, char *format, ...);
+static void finish(tracer *d);
+
+// The first bytes of a trace file.
+static const char MAGIC[4] = { 'S', 'K', 'T', 1 };
+
+// Create a trace display, and open its golden or output file.
+static display *traceOpen(char *file, int width, int height) {
+    tracer *d = malloc(sizeof(tracer));
+    *d = (tracer) { .file = file, .hash = 14695981039346656037ULL };
+    char *mode = getenv("SKETCH_TRACE");
+    if (mode != NULL && strcmp(mode, "record") == 0) d->mode = RECORD;
+    else if (mode != NULL && strcmp(mode, "hash") == 0) d->mode = HASH;
+    else d->mode = VERIFY;
+
+    // Swap the .sketch extension, if any, for .trace.
+    int n = strlen(file);
+    d->path = malloc(n + 7);
+    strcpy(d->path, file);
+    char *dot = strrchr(d->path, '.');
+    if (dot != NULL && strcmp(dot, ".sketch") == 0) n = dot - d->path;
+    strcpy(d->path + n, ".trace");
+
+    char magic[4];
+    if (d->mode == RECORD) {
+        d->golden = fopen(d->path, "wb");
+        if (d->golden == NULL) fail(d, "Can't write %s\n", d->path);
+        else fwrite(MAGIC, 1, 4, d->golden);
+    } else if (d->mode == VERIFY && (d->golden = fopen(d->path, "rb"))) {
+        if (fread(magic, 1, 4, d->golden) != 4 || memcmp(magic, MAGIC, 4)) {
+            fail(d, "%s isn't a trace file\n", d->path);
+        }
+    } else if (d->mode == VERIFY) {
+        // Without a trace, fall back to the count and hash alone.
+        strcpy(d->path + n, ".hash");
+        FILE *in = fopen(d->path, "r");
+        if (in == NULL) {
+            fail(d, "No golden trace or hash for %s\n", file);
+            return &d->base;
+        }
+        int found = fscanf(in, "%ld %" SCNx64, &d->goldenCount,
+                           &d->goldenHash);
+        fclose(in);
+        if (found != 2) fail(d, "%s isn't a hash file\n", d->path);
+    }
+    return &d->base;
+}
+
+static void traceLine(display *d, int x0, int y0, int x1, int y1) {
+    record r = { LINE, { x0, y0, x1, y1 } };
+    trace((tracer *) d, &r);
+}
+
+static void traceColour(display *d, int rgba) {
+    record r = { COLOUR, { rgba } };
+    trace((tracer *) d, &r);
+}
+
+static void tracePause(display *d, int ms) {
+    record r = { PAUSE, { ms } };
+    trace((tracer *) d, &r);
+    callHook(d);
+}
+
+static void traceClear(display *d) {
+    record r = { CLEAR };
+    trace((tracer *) d, &r);
+}
+
+// Calls to show(...) don't affect the drawing, so they aren't traced.
+static void traceShow(display *d) {
+}
+
+static char traceKey(display *d) {
+    record r = { KEY };
+    trace((tracer *) d, &r);
+    callHook(d);
+    return '?';
+}
+
+// Finish the trace, checking that it ended where the golden one does.
+static bool traceEnd(display *base) {
+    callHook(base);
+    tracer *d = (tracer *) base;
+    record r = { END };
+    if (d->failed) {
+        // The failure has already been reported, so there is nothing to add.
+    } else if (d->mode == RECORD) {
+        writeRecord(d->golden, &r);
+        int closed = fclose(d->golden);
+        d->golden = NULL;
+        if (closed != 0) fail(d, "Can't write %s\n", d->path);
+        else printf("Recorded %s (%ld calls)\n", d->path, d->n);
+    } else if (d->mode == HASH) {
+        int n = strlen(d->path) - strlen(".trace");
+        strcpy(d->path + n, ".hash");
+        FILE *out = fopen(d->path, "w");
+        if (out != NULL) {
+            fprintf(out, "%ld %016" PRIx64 "\n", d->n, d->hash);
+        }
+        if (out == NULL || fclose(out) != 0) {
+            fail(d, "Can't write %s\n", d->path);
+        } else {
+            printf("Recorded %s (%ld calls)\n", d->path, d->n);
+        }
+    } else if (d->golden != NULL) {
+        check(d, &r);
+    } else if (d->n != d->goldenCount || d->hash != d->goldenHash) {
+        fail(d, "Made %ld calls with hash %016" PRIx64 ", expecting %ld "
+             "with hash %016" PRIx64 "\n", d->n, d->hash,
+             d->goldenCount, d->goldenHash);
+    }
+    if (d->mode == VERIFY && !d->failed) {
+        printf("Trace %s OK (%ld calls)\n", d->file, d->n);
+    }
+    bool ok = !d->failed;
+    finish(d);
+    return ok;
+}
+
+// Stop tracing without checking the end.  A trace being recorded is left
+// unfinished, so it is removed rather than kept as a golden trace.
+static void traceDiscard(display *base) {
+    tracer *d = (tracer *) base;
+    if (d->mode == RECORD && d->golden != NULL) {
+        fclose(d->golden);
+        d->golden = NULL;
+        remove(d->path);
+    }
+    finish(d);
+}
+
+// There is no picture to save or digest.
+const backend traceBackend = {
+    .name = "trace", .open = traceOpen, .line = traceLine,
+    .colour = traceColour, .pause = tracePause, .clear = traceClear,
+    .show = traceShow, .key = traceKey, .end = traceEnd,
+    .discard = traceDiscard
+};
+
+// ------------ Records --------------------------------------------------------
+
+// Write or check a call, depending on the mode, and add it to the hash.  Once
+// the trace has failed, calls are ignored.
+static void trace(tracer *d, record *r) {
+    if (d->failed) return;
+    if (d->mode == RECORD) writeRecord(d->golden, r);
+    if (d->mode == VERIFY && d->golden != NULL) check(d, r);
+
+    // Hash the record exactly as it is laid out in a trace file.
+    unsigned char bytes[17] = { r->kind };
+    for (int i = 0; i < arguments[r->kind]; i++) {
+        for (int k = 0; k < 4; k++) bytes[1 + 4*i + k] = r->a[i] >> (8 * k);
+    }
+    for (int i = 0; i < 1 + 4 * arguments[r->kind]; i++) {
+        d->hash = (d->hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    d->n++;
+}
+
+// Check a call against the next one in the golden trace.
+static void check(tracer *d, record *r) {
+    record expect;
+    bool more = readRecord(d->golden, &expect);
+    if (more && expect.kind == r->kind &&
+        memcmp(expect.a, r->a, arguments[r->kind] * sizeof(int32_t)) == 0) {
+        return;
+    }
+    char got[100], wanted[100];
+    describe(got, r);
+    if (!more) {
+        fail(d, "Call %ld is %s, after the trace ends\n", d->n, got);
+        return;
+    }
+    describe(wanted, &expect);
+    fail(d, "Call %ld is %s, expecting %s\n", d->n, got, wanted);
+}
+
+// Read a record, returning false at the end of the calls.
+static bool readRecord(FILE *in, record *r) {
+    int kind = getc(in);
+    if (kind < 0 || kind > END) return false;
+    r->kind = kind;
+    for (int i = 0; i < arguments[kind]; i++) {
+        unsigned char b[4];
+        if (fread(b, 1, 4, in) != 4) return false;
+        uint32_t a = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+        r->a[i] = (int32_t) a;
+    }
+    return true;
+}
+
+// Write a record.
+static void writeRecord(FILE *out, record *r) {
+    putc(r->kind, out);
+    for (int i = 0; i < arguments[r->kind]; i++) {
+        uint32_t a = r->a[i];
+        unsigned char b[4] = { a, a >> 8, a >> 16, a >> 24 };
+        fwrite(b, 1, 4, out);
+    }
+}
+
+// Describe a call in the same way as the test display does.
+static void describe(char *out, record *r) {
+    int32_t *a = r->a;
+    if (r->kind == LINE) {
+        sprintf(out, "line(d,%d,%d,%d,%d)", a[0], a[1], a[2], a[3]);
+    } else if (r->kind == COLOUR) {
+        sprintf(out, "colour(d,0x%08x)", (unsigned) a[0]);
+    } else if (r->kind == PAUSE) {
+        sprintf(out, "pause(d,%d)", a[0]);
+    } else if (r->kind == CLEAR) {
+        sprintf(out, "clear(d)");
+    } else if (r->kind == KEY) {
+        sprintf(out, "key(d)");
+    } else {
+        sprintf(out, "end(d)");
+    }
+}
+
+// Report a failure, if it is the first.
+static void fail(tracer *d, char *format, ...) {
+    if (d->failed) return;
+    d->failed = true;
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "Failure in %s\n", d->file);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// Close the golden file, if it is open, and free the display.
+static void finish(tracer *d) {
+    if (d->golden != NULL) fclose(d->golden);
+    free(d->path);
+    free(d);
+}
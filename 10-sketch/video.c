@@ -0,0 +1,182 @@
+/* An implementation of the display module which draws into an in-memory canvas
+and writes the animation to stdout as a video stream, for publishing sketches
+without recording the screen.  The stream has a fixed frame rate, 30 frames per
+second unless the environment variable SKETCH_FPS says otherwise, and each
+picture is repeated for as many frames as the pause after it lasts.  A key wait
+shows the picture for at least one frame, and end() holds the final picture for
+five seconds, as the window does.
+
+The stream is YUV4MPEG2 with full-resolution 4:4:4 colour, which most video
+tools accept directly, or raw RGBA frames if SKETCH_VIDEO is set to rgba.
+Frames are written as they are due, so memory use doesn't depend on the length
+of the sketch.  A display of size 0 by 0 falls back to 200 by 200, since a video
+needs its size up front. */
+
+#include "backend.h"
+#include "canvas.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct video {
+    display base;
+    canvas *canvas;
+    int width, height;
+    uint32_t rgba;
+    bool y4m;              // Write YUV4MPEG2 rather than raw RGBA?
+    int fps;
+    long frames;           // Number of frames written so far.
+    bool changed;          // Has the picture changed since it was encoded?
+    unsigned char *frame;  // The current picture, encoded.
+    size_t size;           // Size of an encoded frame, in bytes.
+    uint32_t *row;
+    bool failed;           // Has writing the stream failed?
+};
+typedef struct video video;
+
+// Encode the current picture, as planes of Y, U and V samples using the BT.601
+// studio-range coefficients, or as rows of RGBA bytes.
+static void encode(video *d) {
+    int w = d->width, h = d->height;
+    unsigned char *Y = d->frame, *U = Y + w * h, *V = U + w * h;
+    for (int y = 0; y < h; y++) {
+        copyRow(d->canvas, y, d->row);
+        for (int x = 0; x < w; x++) {
+            uint32_t p = d->row[x];
+            int r = p >> 24, g = (p >> 16) & 0xFF, b = (p >> 8) & 0xFF;
+            int i = y * w + x;
+            if (!d->y4m) {
+                unsigned char *q = &d->frame[4 * i];
+                q[0] = r; q[1] = g; q[2] = b; q[3] = p & 0xFF;
+                continue;
+            }
+            Y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            U[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            V[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+    d->changed = false;
+}
+
+// Report that the stream can't be written, the first time it happens.
+static void failed(video *d) {
+    if (!d->failed) fprintf(stderr, "Error: can't write video\n");
+    d->failed = true;
+}
+
+// Write the current picture as many times as it takes to bring the video up to
+// the given virtual time, and at least once if asked.  Once writing has failed,
+// nothing more is written.
+static void advance(video *d, long ms, bool once) {
+    if (d->failed) return;
+    long due = (long) ((double) ms * d->fps / 1000);
+    if (once && due <= d->frames) due = d->frames + 1;
+    if (due > d->frames && d->changed) encode(d);
+    for (; d->frames < due; d->frames++) {
+        if (d->y4m) fputs("FRAME\n", stdout);
+        if (fwrite(d->frame, 1, d->size, stdout) != d->size) {
+            failed(d);
+            return;
+        }
+    }
+}
+
+// Create a new display object, with a white canvas and a black pen, and write
+// the stream header.
+static display *videoOpen(char *title, int width, int height) {
+    if (width <= 0 || height <= 0) { width = 200; height = 200; }
+    video *d = malloc(sizeof(video));
+    char *format = getenv("SKETCH_VIDEO"), *fps = getenv("SKETCH_FPS");
+    d->canvas = newCanvas(width, height, 0xFFFFFFFF);
+    d->width = width; d->height = height;
+    d->rgba = 0x000000FF;
+    d->y4m = format == NULL || strcmp(format, "rgba") != 0;
+    d->fps = fps != NULL && atoi(fps) > 0 ? atoi(fps) : 30;
+    d->frames = 0;
+    d->changed = true;
+    d->size = (size_t) width * height * (d->y4m ? 3 : 4);
+    d->frame = malloc(d->size);
+    d->row = malloc(width * sizeof(uint32_t));
+    d->failed = false;
+    if (d->y4m) {
+        printf("YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, d->fps);
+    }
+    return &d->base;
+}
+
+static void videoLine(display *base, int x0, int y0, int x1, int y1) {
+    video *d = (video *) base;
+    drawLine(d->canvas, x0, y0, x1, y1, d->rgba);
+    d->changed = true;
+}
+
+static void videoColour(display *d, int rgba) {
+    ((video *) d)->rgba = (uint32_t) rgba;
+}
+
+static void videoClear(display *base) {
+    video *d = (video *) base;
+    fillCanvas(d->canvas, 0xFFFFFFFF);
+    d->changed = true;
+}
+
+// Pauses take no real time; the picture is held in the video instead.
+static void videoPause(display *d, int ms) {
+    callHook(d);
+    advance((video *) d, d->clock + ms, false);
+}
+
+// A skipped part of the sketch is left out of the video, which carries on from
+// the frame due at the new time.
+static void videoSkip(display *base, long ms) {
+    video *d = (video *) base;
+    long due = (long) ((double) (base->clock + ms) * d->fps / 1000);
+    if (due > d->frames) d->frames = due;
+}
+
+// Pictures only reach the video at pauses, key waits and the end.
+static void videoShow(display *d) {
+}
+
+// There is no keyboard, so show the picture briefly and carry on.
+static char videoKey(display *d) {
+    callHook(d);
+    advance((video *) d, d->clock, true);
+    return '?';
+}
+
+// Free the display, leaving the stream as far as it has been written.
+static void videoDiscard(display *base) {
+    video *d = (video *) base;
+    freeCanvas(d->canvas);
+    free(d->frame);
+    free(d->row);
+    free(d);
+}
+
+// Hold the final picture, finish the stream, and free the display.
+static bool videoEnd(display *base) {
+    callHook(base);
+    video *d = (video *) base;
+    advance(d, base->clock + 5000, true);
+    if (fflush(stdout) != 0) failed(d);
+    bool ok = !d->failed;
+    videoDiscard(base);
+    return ok;
+}
+
+static bool videoSnapshot(display *d, char *path) {
+    return savePPM(((video *) d)->canvas, path);
+}
+
+static bool videoDigest(display *d, uint64_t *out) {
+    return digestCanvas(((video *) d)->canvas, out);
+}
+
+// Video time follows the virtual clock, so the speed is ignored.
+const backend videoBackend = {
+    .name = "video", .open = videoOpen, .line = videoLine,
+    .colour = videoColour, .pause = videoPause, .skip = videoSkip,
+    .clear = videoClear, .show = videoShow, .key = videoKey, .end = videoEnd,
+    .discard = videoDiscard, .snapshot = videoSnapshot, .digest = videoDigest
+};
@@ -0,0 +1,723 @@
+/*
+ * vm.c - reentrant sketch interpreter
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+#include "vm.h"
+
+// Define a structure for the current state.
+struct state {
+    int sx; // Stored x-coordinate of cursor.
+    int sy; // Stored y-coordinate of cursor.
+
+    int cx; // Current x-coordinate of cursor.
+    int cy; // Current y-coordinate of cursor.
+
+    bool PD; // Is the pen down?
+};
+typedef struct state state;
+
+// Define a structure for the repeat blocks being run, innermost last: where the
+// body of each starts, and how many more times it is to be run.
+struct block { long start; long count; };
+struct loops { int depth; struct block block[LOOPS]; };
+typedef struct loops loops;
+
+// Define a structure for everything one run of the interpreter uses.
+struct sketch_vm {
+    display * D;
+    state S;
+    bool replay; // Skip pauses and key waits while catching up after a seek.
+    int ox, oy;  // Point drawn at the top left corner of the display.
+    int width, height; // Size of the part shown, or 0 by 0 for everything.
+    stats * st;  // Profiling counters, or NULL if none are being kept.
+    ring input;  // Bytes fed in but not yet run.
+
+    // Repeat blocks fed in.  Their bytes are kept as they are run, so that
+    // they can be run again once the end of the outermost one arrives.
+    loops L;
+    int skipping;         // Depth of blocks being skipped, or 0.
+    unsigned char * kept; // Bytes of the outermost block so far.
+    size_t length, capacity;
+};
+
+// Define a structure for a keyframe, which holds everything needed to resume a
+// program part way through, apart from the picture.
+struct keyframe {
+    long at;      // Number of instructions run so far.
+    long offset;  // Byte offset of the next instruction.
+    state S;      // State of the interpreter.
+    int rgba;     // Current colour, if one has been set.
+    bool coloured;
+    long clock;   // Virtual time, in milliseconds.
+    int keys;     // Number of key waits passed.
+    long cleared; // Index of the last clear instruction, or -1 if none.
+    loops L;      // Repeat blocks being run.
+};
+typedef struct keyframe keyframe;
+
+// Define a structure for an index of keyframes, one every KEYFRAME instructions
+// as far into the program as seeks have scanned.  Each keyframe is kept with
+// the one just after the last clear before it, which the picture is replayed
+// from, and the latest virtual time reached by then, since pauses can be
+// negative.
+enum { KEYFRAME = 1 << 16 };
+struct mark { keyframe k, r; long latest; };
+struct keyframes { int length, capacity; struct mark * marks; bool grown; };
+
+// Index files start with this magic string, followed by a version byte, and
+// have a header of INDEX bytes, then MARK bytes for each keyframe and its
+// replay point, each of which takes KEYBYTES bytes.
+static const char MAGIC[4] = "SKI";
+static const int VERSION = 1;
+enum { INDEX = 28, KEYBYTES = 315, MARK = 2 * KEYBYTES + 8 };
+
+// Declare function signatures.
+static struct mark * before(keyframes * index, long at, long ms);
+static void record(keyframes * index, struct mark m);
+static unsigned char * storeKeyframe(unsigned char * p, keyframe * k);
+static bool loadKeyframe(const unsigned char ** p, keyframe * k, long size);
+static unsigned char * store(unsigned char * p, uint64_t value, int n);
+static uint64_t load(const unsigned char ** p, int n);
+static bool step(keyframe * k, const unsigned char * p,
+                 const unsigned char * end);
+static bool run_bytes(sketch_vm * vm, const unsigned char * p, long at,
+                      const unsigned char * end, loops * L);
+static bool stream(sketch_vm * vm, unsigned char * bytes, int n,
+                   instruction i);
+static bool enter(loops * L, long start, long count);
+static bool next(loops * L, long * at);
+static bool execute(sketch_vm * vm, int byte, instruction i);
+static void profile(sketch_vm * vm, int form, instruction i);
+static bool clip(sketch_vm * vm, int * x0, int * y0, int * x1, int * y1);
+static int nearest(double v);
+static void dx(sketch_vm * vm, int operand);
+static void dy(sketch_vm * vm, int operand);
+static void dt(sketch_vm * vm, int operand);
+static void pn(sketch_vm * vm, int operand);
+static void cl(sketch_vm * vm, int operand);
+static void ky(sketch_vm * vm, int operand);
+static void hu(sketch_vm * vm, int rgba);
+static void lp(sketch_vm * vm, int operand);
+static void nx(sketch_vm * vm, int operand);
+
+// Define the handler for each opcode.
+static void (* const handlers[])(sketch_vm * vm, int operand) = {
+    dx, dy, dt, pn, cl, ky, hu, lp, nx
+};
+
+sketch_vm * vm_new(display * d) {
+    sketch_vm * vm = malloc(sizeof(sketch_vm));
+    vm->D = d;
+    vm->S = (state) { .sx = 0, .sy = 0, .cx = 0, .cy = 0, .PD = false };
+    vm->replay = false;
+    vm->ox = 0; vm->oy = 0;
+    vm->width = 0; vm->height = 0;
+    vm->st = NULL;
+    clearRing(&vm->input);
+    vm->L.depth = 0;
+    vm->skipping = 0;
+    vm->kept = NULL;
+    vm->length = 0; vm->capacity = 0;
+    return vm;
+}
+
+void vm_view(sketch_vm * vm, int x, int y, int width, int height) {
+    vm->ox = x; vm->oy = y;
+    vm->width = width; vm->height = height;
+}
+
+void vm_stats(sketch_vm * vm, stats * s) {
+    vm->st = s;
+}
+
+void vm_free(sketch_vm * vm) {
+    free(vm->kept);
+    free(vm);
+}
+
+size_t vm_feed(sketch_vm * vm, const unsigned char * bytes, size_t n) {
+    return pushRing(&vm->input, bytes, n);
+}
+
+long vm_read(sketch_vm * vm, int fd) {
+    return fillRing(&vm->input, fd);
+}
+
+int vm_step(sketch_vm * vm) {
+    // An instruction whose operand bytes haven't all arrived yet stays in the
+    // buffer until more are fed in.
+    ring * r = &vm->input;
+    unsigned char bytes[5];
+    if (ringLength(r) == 0) return 0;
+    peekRing(r, bytes, 1);
+    size_t n = width(bytes[0]);
+    if (ringLength(r) < n) return 0;
+    peekRing(r, bytes, n); dropRing(r, n);
+
+    instruction i;
+    if (decode(bytes, bytes + n, &i) < 0) {
+        fprintf(stderr, "error: unknown opcode\n");
+        return -1;
+    }
+    return stream(vm, bytes, n, i) ? 1 : -1;
+}
+
+bool vm_run(sketch_vm * vm) {
+    int result;
+    while ((result = vm_step(vm)) > 0);
+    double t = vm->st != NULL ? clockSeconds() : 0;
+    show(vm->D);
+    if (vm->st != NULL) countCall(vm->st, ON_SHOW, t);
+    return result == 0;
+}
+
+bool vm_finish(sketch_vm * vm) {
+    if (ringLength(&vm->input) > 0) {
+        fprintf(stderr, "error: truncated instruction\n");
+        return false;
+    }
+    if (vm->L.depth > 0 || vm->skipping > 0) {
+        fprintf(stderr, "error: unterminated loop\n");
+        return false;
+    }
+    return true;
+}
+
+bool vm_run_bytes(sketch_vm * vm, const unsigned char * p,
+                  const unsigned char * end) {
+    loops L = { .depth = 0 };
+    return run_bytes(vm, p, 0, end, &L);
+}
+
+bool vm_run_packed(sketch_vm * vm, const packed * prog) {
+    // Packed programs are checked as they are opened, so dispatch without
+    // checks.  They don't record how their instructions were encoded, though.
+    loops L = { .depth = 0 };
+    int j = 0;
+    for (; j < prog->length; j++) {
+        instruction i = unpack(prog, j);
+        if (vm->st != NULL) profile(vm, -1, i);
+        else handlers[i.opcode](vm, i.operand);
+        if (i.opcode < LP) continue;
+
+        // Go back to the start of a block's body, or skip an empty block.
+        long at = j + 1;
+        if (i.opcode == LP && i.operand <= 0) at = skipPackedBlock(prog, j + 1);
+        else if (i.opcode == LP && !enter(&L, j + 1, i.operand)) return false;
+        else if (i.opcode == NX && !next(&L, &at)) return false;
+        if (at < 0) break;
+        j = at - 1;
+    }
+    if (L.depth > 0 || j < prog->length) {
+        fprintf(stderr, "error: unterminated loop\n");
+        return false;
+    }
+    return true;
+}
+
+// The program is scanned without drawing up to the target, from the nearest
+// keyframe before it, remembering where it was just after the last clear, and
+// then the picture is rebuilt by replaying only the part since that clear,
+// without pauses or key waits.
+bool vm_seek(sketch_vm * vm, const unsigned char * p, const unsigned char * end,
+             long at, long ms, keyframes * index) {
+    keyframe k = { .at = 0, .offset = 0, .S = { 0, 0, 0, 0, false },
+                   .rgba = 0, .coloured = false, .clock = 0, .keys = 0,
+                   .cleared = -1, .L = { .depth = 0 } };
+    keyframe r = k;
+    long latest = 0;
+    struct mark * m = index != NULL ? before(index, at, ms) : NULL;
+    if (m != NULL) { k = m->k; r = m->r; latest = m->latest; }
+
+    // Add keyframes to the index as the scan passes the end of it.
+    while (p + k.offset < end && (at >= 0 ? k.at < at : k.clock < ms)) {
+        long cleared = k.cleared;
+        if (!step(&k, p, end)) {
+            fprintf(stderr, "error: bad instruction at byte %ld\n", k.offset);
+            return false;
+        }
+        if (k.cleared != cleared) r = k;
+        if (k.clock > latest) latest = k.clock;
+        if (index != NULL && k.at == (index->length + 1L) * KEYFRAME) {
+            record(index, (struct mark) { k, r, latest });
+        }
+    }
+
+    // Restore the state just after the last clear, and redraw everything
+    // since.  If the target is outside any repeat block, every block open
+    // after the clear ends before it, so the bytes up to the target can be run
+    // as they are.  Otherwise, the blocks are followed as the scan did.
+    vm->S = r.S;
+    if (r.coloured) colour(vm->D, r.rgba);
+    vm->replay = true;
+    if (k.L.depth == 0 && !run_bytes(vm, p, r.offset, p + k.offset, &r.L)) {
+        return false;
+    }
+    while (k.L.depth > 0 && r.at < k.at) {
+        instruction i;
+        decode(p + r.offset, end, &i);
+        execute(vm, p[r.offset], i);
+        step(&r, p, end);
+    }
+    vm->replay = false;
+
+    // Carry on as normal, from the virtual time reached, with the scripted
+    // keys that the key waits passed would have taken used up.
+    skip(vm->D, k.clock, k.keys);
+    return run_bytes(vm, p, k.offset, end, &k.L);
+}
+
+keyframes * vm_index(const unsigned char * bytes, size_t n,
+                     struct stat * info) {
+    keyframes * index = malloc(sizeof(keyframes));
+    *index = (keyframes) { .length = 0, .capacity = 0, .marks = NULL,
+                           .grown = false };
+
+    // Check that the sidecar is current before trusting its contents, and
+    // that the count accounts for exactly the rest of it.
+    const unsigned char * p = bytes;
+    if (p == NULL || n < INDEX || memcmp(p, MAGIC, 3) != 0) return index;
+    p += 3;
+    bool ok = load(&p, 1) == (uint64_t) VERSION;
+    ok = ok && load(&p, 8) == (uint64_t) info->st_size;
+    ok = ok && load(&p, 8) == (uint64_t) info->st_mtime;
+    ok = ok && load(&p, 4) == KEYFRAME;
+    uint64_t length = ok ? load(&p, 4) : 0;
+    ok = ok && length <= INT_MAX / MARK && n - INDEX == length * MARK;
+    if (!ok) return index;
+
+    // Check that each keyframe is where it should be, and could be part of
+    // the program, so that seeks can resume from it without checks.
+    struct mark * marks = malloc(length * sizeof(struct mark));
+    long size = (long) info->st_size;
+    for (int i = 0; i < (int) length; i++) {
+        struct mark * m = &marks[i];
+        ok = loadKeyframe(&p, &m->k, size) && ok;
+        ok = loadKeyframe(&p, &m->r, size) && ok;
+        m->latest = (long) (int64_t) load(&p, 8);
+        ok = ok && m->k.at == (i + 1L) * KEYFRAME && m->r.at <= m->k.at;
+    }
+    if (!ok) { free(marks); return index; }
+    index->marks = marks;
+    index->length = index->capacity = (int) length;
+    return index;
+}
+
+unsigned char * vm_pack_index(keyframes * index, struct stat * info,
+                              size_t * n) {
+    if (!index->grown) return NULL;
+    *n = INDEX + (size_t) index->length * MARK;
+    unsigned char * bytes = malloc(*n), * p = bytes;
+    memcpy(p, MAGIC, 3); p = store(p + 3, VERSION, 1);
+    p = store(p, (uint64_t) info->st_size, 8);
+    p = store(p, (uint64_t) info->st_mtime, 8);
+    p = store(p, KEYFRAME, 4); p = store(p, index->length, 4);
+    for (int i = 0; i < index->length; i++) {
+        struct mark * m = &index->marks[i];
+        p = storeKeyframe(p, &m->k);
+        p = storeKeyframe(p, &m->r);
+        p = store(p, (uint64_t) m->latest, 8);
+    }
+    return bytes;
+}
+
+void vm_free_index(keyframes * index) {
+    free(index->marks);
+    free(index);
+}
+
+// Find the last keyframe in an index which is before a seek's target, the
+// instruction numbered at or, if at is negative, the first instruction
+// reached at virtual time ms.  Return NULL if there is none.
+static struct mark * before(keyframes * index, long at, long ms) {
+    struct mark * m = NULL;
+    for (int i = 0; i < index->length; i++) {
+        struct mark * next = &index->marks[i];
+        if (at >= 0 ? next->k.at > at : next->latest >= ms) break;
+        m = next;
+    }
+    return m;
+}
+
+// Add a keyframe to the end of an index.
+static void record(keyframes * index, struct mark m) {
+    if (index->length == index->capacity) {
+        index->capacity = (index->capacity + 1) * 2;
+        size_t size = index->capacity * sizeof(struct mark);
+        index->marks = realloc(index->marks, size);
+    }
+    index->marks[index->length++] = m;
+    index->grown = true;
+}
+
+// Write a keyframe as KEYBYTES bytes of little-endian integers, with room for
+// the deepest repeat blocks, and return the position after it.
+static unsigned char * storeKeyframe(unsigned char * p, keyframe * k) {
+    p = store(p, (uint64_t) k->at, 8);
+    p = store(p, (uint64_t) k->offset, 8);
+    p = store(p, (uint32_t) k->S.sx, 4); p = store(p, (uint32_t) k->S.sy, 4);
+    p = store(p, (uint32_t) k->S.cx, 4); p = store(p, (uint32_t) k->S.cy, 4);
+    p = store(p, k->S.PD, 1);
+    p = store(p, (uint32_t) k->rgba, 4); p = store(p, k->coloured, 1);
+    p = store(p, (uint64_t) k->clock, 8);
+    p = store(p, (uint32_t) k->keys, 4);
+    p = store(p, (uint64_t) k->cleared, 8);
+    p = store(p, k->L.depth, 1);
+    for (int i = 0; i < LOOPS; i++) {
+        struct block b = { 0, 0 };
+        if (i < k->L.depth) b = k->L.block[i];
+        p = store(p, (uint64_t) b.start, 8);
+        p = store(p, (uint64_t) b.count, 8);
+    }
+    return p;
+}
+
+// Read a keyframe written by storeKeyframe, moving the position past it.
+// Return false if it can't be a keyframe of a program of the given size.
+static bool loadKeyframe(const unsigned char ** p, keyframe * k, long size) {
+    k->at = (long) (int64_t) load(p, 8);
+    k->offset = (long) (int64_t) load(p, 8);
+    k->S.sx = (int32_t) load(p, 4); k->S.sy = (int32_t) load(p, 4);
+    k->S.cx = (int32_t) load(p, 4); k->S.cy = (int32_t) load(p, 4);
+    k->S.PD = load(p, 1) != 0;
+    k->rgba = (int32_t) load(p, 4); k->coloured = load(p, 1) != 0;
+    k->clock = (long) (int64_t) load(p, 8);
+    k->keys = (int32_t) load(p, 4);
+    k->cleared = (long) (int64_t) load(p, 8);
+    k->L.depth = (int) load(p, 1);
+    bool ok = k->at >= 0 && k->offset >= 0 && k->offset <= size;
+    ok = ok && k->keys >= 0 && k->L.depth <= LOOPS;
+    for (int i = 0; i < LOOPS; i++) {
+        struct block b;
+        b.start = (long) (int64_t) load(p, 8);
+        b.count = (long) (int64_t) load(p, 8);
+        if (i >= k->L.depth) continue;
+        ok = ok && b.start >= 0 && b.start <= size && b.count > 0;
+        k->L.block[i] = b;
+    }
+    return ok;
+}
+
+// Write the low n bytes of a value, least significant first, and return the
+// position after them.
+static unsigned char * store(unsigned char * p, uint64_t value, int n) {
+    for (int i = 0; i < n; i++) p[i] = (unsigned char) (value >> (8 * i));
+    return p + n;
+}
+
+// Read an n byte value, least significant first, moving the position past it.
+static uint64_t load(const unsigned char ** p, int n) {
+    uint64_t value = 0;
+    for (int i = 0; i < n; i++) value |= (uint64_t) (*p)[i] << (8 * i);
+    *p += n;
+    return value;
+}
+
+// Advance a keyframe past one instruction, without drawing anything, following
+// repeat blocks.  Return false at the end of the program, or if the
+// instruction can't be decoded.
+static bool step(keyframe * k, const unsigned char * p,
+                 const unsigned char * end) {
+    if (p + k->offset >= end) return false;
+    instruction i;
+    int used = decode(p + k->offset, end, &i);
+    if (used <= 0) return false;
+
+    state * S = &k->S;
+    if (i.opcode == DX) {
+        S->cx += i.operand;
+    } else if (i.opcode == DY) {
+        S->cy += i.operand;
+        S->sx = S->cx; S->sy = S->cy;
+    } else if (i.opcode == DT) {
+        k->clock += i.operand * 10;
+    } else if (i.opcode == PN) {
+        S->PD = !S->PD;
+    } else if (i.opcode == CL) {
+        k->cleared = k->at;
+    } else if (i.opcode == KY) {
+        k->keys++;
+    } else if (i.opcode == HU) {
+        k->rgba = i.operand; k->coloured = true;
+    }
+
+    // Go back to the start of a block's body, or skip an empty block.
+    long offset = k->offset + used;
+    if (i.opcode == LP && i.operand <= 0) {
+        const unsigned char * after = skipBlock(p + offset, end);
+        if (after == NULL) return false;
+        offset = after - p;
+    } else if (i.opcode == LP && !enter(&k->L, offset, i.operand)) {
+        return false;
+    } else if (i.opcode == NX && !next(&k->L, &offset)) {
+        return false;
+    }
+    k->at++; k->offset = offset;
+    return true;
+}
+
+// Run a program held in memory from byte offset at up to end, with explicit
+// bounds on every read, given the repeat blocks already being run.
+static bool run_bytes(sketch_vm * vm, const unsigned char * p, long at,
+                      const unsigned char * end, loops * L) {
+    // Instructions which are being counted all go the slow way.
+    bool fast = vm->st == NULL;
+    const unsigned char * q = p + at;
+    while (q < end) {
+        // Dispatch single-byte instructions straight from the decoding table.
+        const entry * e = &decoding[*q];
+        if (fast && e->extra == 0 && e->opcode >= 0 && e->opcode <= HU) {
+            handlers[e->opcode](vm, e->operand); q++;
+            continue;
+        }
+
+        instruction i;
+        int used = decode(q, end, &i);
+        if (used == 0) {
+            fprintf(stderr, "error: truncated instruction\n");
+            return false;
+        }
+        if (used < 0 || !execute(vm, *q, i)) {
+            fprintf(stderr, "error: unknown opcode\n");
+            return false;
+        }
+        q += used;
+
+        // Go back to the start of a block's body, or skip an empty block.
+        long offset = q - p;
+        if (i.opcode == LP && i.operand <= 0) q = skipBlock(q, end);
+        else if (i.opcode == LP && !enter(L, offset, i.operand)) return false;
+        else if (i.opcode == NX && !next(L, &offset)) return false;
+        else if (i.opcode == NX) q = p + offset;
+        if (q == NULL) break;
+    }
+    if (q == NULL || L->depth > 0) {
+        fprintf(stderr, "error: unterminated loop\n");
+        return false;
+    }
+    return true;
+}
+
+// Run an instruction fed in.  A repeat block is run once as it arrives, with
+// its bytes kept, and the rest of the times from the kept bytes once its end
+// arrives.  A block which is to be run no times is skipped as it arrives.
+static bool stream(sketch_vm * vm, unsigned char * bytes, int n,
+                   instruction i) {
+    loops * L = &vm->L;
+    if (L->depth > 0) {
+        if (vm->length + n > vm->capacity) {
+            vm->capacity = (vm->capacity + n) * 2;
+            vm->kept = realloc(vm->kept, vm->capacity);
+        }
+        for (int j = 0; j < n; j++) vm->kept[vm->length++] = bytes[j];
+    }
+    if (vm->skipping > 0) {
+        if (i.opcode == LP) vm->skipping++;
+        else if (i.opcode == NX) vm->skipping--;
+        return true;
+    }
+    if (!execute(vm, bytes[0], i)) {
+        fprintf(stderr, "error: unknown opcode\n");
+        return false;
+    }
+
+    if (i.opcode == LP && i.operand <= 0) vm->skipping = 1;
+    else if (i.opcode == LP) return enter(L, vm->length, i.operand);
+    if (i.opcode != NX) return true;
+
+    // Run the body again from the kept bytes, leaving out this NX, which is
+    // counted again after each pass.
+    if (L->depth == 0) {
+        fprintf(stderr, "error: next without loop\n");
+        return false;
+    }
+    struct block b = L->block[--L->depth];
+    const unsigned char * body = vm->kept + b.start;
+    const unsigned char * end = vm->kept + vm->length - n;
+    for (long k = 1; k < b.count; k++) {
+        loops inner = { .depth = 0 };
+        if (!run_bytes(vm, body, 0, end, &inner)) return false;
+        execute(vm, bytes[0], i);
+    }
+    if (L->depth == 0) vm->length = 0;
+    return true;
+}
+
+// Start a repeat block whose body starts at the given position, to be run
+// count times.  Return false after reporting an error if blocks are nested
+// too deeply.
+static bool enter(loops * L, long start, long count) {
+    if (L->depth == LOOPS) {
+        fprintf(stderr, "error: loops nested too deeply\n");
+        return false;
+    }
+    L->block[L->depth++] = (struct block) { start, count };
+    return true;
+}
+
+// End a pass through the body of the innermost repeat block, and if it is to
+// be run again, set the position to the start of its body.  Return false after
+// reporting an error if there is no block to end.
+static bool next(loops * L, long * at) {
+    if (L->depth == 0) {
+        fprintf(stderr, "error: next without loop\n");
+        return false;
+    }
+    struct block * b = &L->block[L->depth - 1];
+    if (--b->count > 0) *at = b->start;
+    else L->depth--;
+    return true;
+}
+
+// Execute a single decoded instruction, which started with the given byte.
+static bool execute(sketch_vm * vm, int byte, instruction i) {
+    if (i.opcode < 0 || i.opcode > NX) return false;
+    if (vm->st != NULL) profile(vm, form(byte), i);
+    else handlers[i.opcode](vm, i.operand);
+    return true;
+}
+
+// Execute an instruction, counting it and timing any display call it makes.
+// The form is the instruction's encoding, or -1 if it isn't known.
+static void profile(sketch_vm * vm, int form, instruction i) {
+    stats * s = vm->st; state * S = &vm->S;
+    s->opcodes[i.opcode]++;
+    if (form >= 0) s->forms[form]++;
+
+    // Find which display call, if any, the instruction will make.  A line
+    // might be culled, so dy() counts the call itself if it is made.
+    int call = -1;
+    if (i.opcode == DY && S->PD) {
+        countLine(s, S->sx, S->sy, S->cx, S->cy + i.operand);
+    } else if (i.opcode == DT && !vm->replay) {
+        call = ON_PAUSE;
+    } else if (i.opcode == CL) {
+        call = ON_CLEAR;
+    } else if (i.opcode == KY && !vm->replay) {
+        call = ON_KEY;
+    } else if (i.opcode == HU) {
+        call = ON_COLOUR;
+    }
+
+    if (call < 0) {
+        handlers[i.opcode](vm, i.operand);
+        return;
+    }
+    double t = clockSeconds();
+    handlers[i.opcode](vm, i.operand);
+    countCall(s, call, t);
+}
+
+// Lines at least this long in either direction are trimmed to the part shown,
+// rather than have the display step along every pixel of them.
+static const double LONGEST = 1 << 30;
+
+// Clip a line to the part shown.  The pixels of a line are never more than half
+// a pixel from it, so a line which misses the part shown by more than a pixel
+// is culled, and nothing is drawn.  Otherwise the whole line is passed on, for
+// the display to clip, so that exactly the visible pixels of the line are
+// drawn.  Only a line too long to step along is trimmed, to where it crosses
+// the edges of the part shown and the margin of a pixel around it, and then a
+// pixel can differ where the line passes between pixels.  The crossings are
+// found by the Liang-Barsky method.
+static bool clip(sketch_vm * vm, int * x0, int * y0, int * x1, int * y1) {
+    if (vm->width == 0 && vm->height == 0) return true;
+    double dx = (double) *x1 - *x0, dy = (double) *y1 - *y0;
+
+    // For each edge of the part shown and its margin, p says how fast the line
+    // moves towards the outside of the edge, and q how far inside the start is.
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = {
+        *x0 + 1.0, (double) vm->width - *x0,
+        *y0 + 1.0, (double) vm->height - *y0
+    };
+    double t0 = 0, t1 = 1;
+    for (int i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) t0 = 2;
+        } else if (p[i] < 0) {
+            if (q[i] / p[i] > t0) t0 = q[i] / p[i];
+        } else if (q[i] / p[i] < t1) t1 = q[i] / p[i];
+    }
+    if (t0 > t1) {
+        if (vm->st != NULL) vm->st->culled++;
+        return false;
+    }
+    if (-LONGEST < dx && dx < LONGEST && -LONGEST < dy && dy < LONGEST) {
+        return true;
+    }
+
+    // Trim the line, to the nearest pixels to where it crosses.  They lie
+    // between the ends, so they fit in an int.
+    double x = *x0, y = *y0;
+    *x0 = nearest(x + t0 * dx); *y0 = nearest(y + t0 * dy);
+    *x1 = nearest(x + t1 * dx); *y1 = nearest(y + t1 * dy);
+    if (vm->st != NULL) vm->st->trimmed++;
+    return true;
+}
+
+// Round to the nearest whole number.
+static int nearest(double v) {
+    return (int) (v < 0 ? v - 0.5 : v + 0.5);
+}
+
+/*
+ * Functions that directly execute given instructions.
+ *****************************************************/
+
+static void dx(sketch_vm * vm, int operand) {
+    vm->S.cx += operand;
+}
+
+static void dy(sketch_vm * vm, int operand) {
+    state * S = &vm->S;
+    S->cy += operand;
+    if (S->PD) {
+        int x0 = S->sx - vm->ox, y0 = S->sy - vm->oy;
+        int x1 = S->cx - vm->ox, y1 = S->cy - vm->oy;
+        if (clip(vm, &x0, &y0, &x1, &y1)) {
+            double t = vm->st != NULL ? clockSeconds() : 0;
+            line(vm->D, x0, y0, x1, y1);
+            if (vm->st != NULL) countCall(vm->st, ON_LINE, t);
+        }
+    }
+    S->sx = S->cx; S->sy = S->cy;
+}
+
+static void dt(sketch_vm * vm, int operand) {
+    if (!vm->replay) pause(vm->D, operand * 10);
+}
+
+static void pn(sketch_vm * vm, int operand) {
+    vm->S.PD = !vm->S.PD;
+}
+
+static void cl(sketch_vm * vm, int operand) {
+    clear(vm->D);
+}
+
+static void ky(sketch_vm * vm, int operand) {
+    if (!vm->replay) key(vm->D);
+}
+
+static void hu(sketch_vm * vm, int rgba) {
+    colour(vm->D, rgba);
+}
+
+// Repeat blocks are run by the callers of the handlers, which know where the
+// instructions are, so these only let them be counted.
+static void lp(sketch_vm * vm, int operand) {
+}
+
+static void nx(sketch_vm * vm, int operand) {
+}
+
+/*****************************************************/
@@ -0,0 +1,92 @@
+/* The vm module is the sketch interpreter as a library.  Everything one run
+uses, the display, the cursor and pen, and any bytes of a partly-arrived
+instruction, lives in a sketch_vm context rather than in globals, so any number
+of interpreters can run at once in one process, each on its own display.
+
+A program can be pushed in as it arrives with vm_feed and run with vm_step or
+vm_run, or run in one go if it is already held in memory.
+*/
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "display.h"
+#include "program.h"
+#include "stats.h"
+
+// A sketch_vm holds the state of one run of the interpreter.
+struct sketch_vm;
+typedef struct sketch_vm sketch_vm;
+
+// Create an interpreter which draws on the given display, with the cursor at
+// the origin and the pen up.
+sketch_vm *vm_new(display *d);
+
+// Show the part of the sketch's coordinate space which is width by height with
+// the point (x,y) at its top left corner, rather than (0,0).  Lines out of that
+// part are culled before they reach the display, unless the size is 0 by 0,
+// which shows everything.  By default, everything is shown from (0,0).
+void vm_view(sketch_vm *vm, int x, int y, int width, int height);
+
+// Keep profiling counters in s for everything the interpreter runs from now
+// on, or stop keeping them if s is NULL.
+void vm_stats(sketch_vm *vm, stats *s);
+
+// Free an interpreter.  Its display is left alone.
+void vm_free(sketch_vm *vm);
+
+// Add up to n bytes to the end of the program, as many as there is room for.
+// Return the number added; running instructions makes room for more.
+size_t vm_feed(sketch_vm *vm, const unsigned char *bytes, size_t n);
+
+// Add whatever bytes are ready on file descriptor fd, waiting if there are
+// none.  Return the number added, 0 at the end of the stream, or -1 on error.
+long vm_read(sketch_vm *vm, int fd);
+
+// Run the next instruction fed in.  Return 1 if one was run, 0 if its bytes
+// haven't all arrived yet, or -1 if it can't be decoded.
+int vm_step(sketch_vm *vm);
+
+// Run every complete instruction fed in, then show what has been drawn.
+// Return false if an instruction can't be decoded.
+bool vm_run(sketch_vm *vm);
+
+// Check that nothing is left over once the program has all been fed in and
+// run.  Return false if the program ends part way through an instruction.
+bool vm_finish(sketch_vm *vm);
+
+// Run a whole program held in memory from p up to end.
+bool vm_run_bytes(sketch_vm *vm, const unsigned char *p,
+                  const unsigned char *end);
+
+// Run a packed program, as held in a sidecar file.
+bool vm_run_packed(sketch_vm *vm, const packed *prog);
+
+// An index of keyframes for a program held in memory: the state of the
+// interpreter every so many instructions, as far into the program as seeks
+// have scanned, so that later seeks can start from the nearest one.  An index
+// can be kept as a sidecar file for the source it was made from.
+struct keyframes;
+typedef struct keyframes keyframes;
+
+// Create an index from the n bytes of a sidecar file for the source described
+// by info.  The index is empty if bytes is NULL, or if the sidecar has the
+// wrong version, was made from a different version of the source, or is cut
+// off or corrupted.
+keyframes *vm_index(const unsigned char *bytes, size_t n, struct stat *info);
+
+// Pack an index as a sidecar file for the source described by info, into a
+// new buffer of *n bytes.  Return NULL if seeks haven't added to the index
+// since it was created, so there is nothing new to save.
+unsigned char *vm_pack_index(keyframes *index, struct stat *info, size_t *n);
+
+// Free an index.
+void vm_free_index(keyframes *index);
+
+// Run a program held in memory, starting part way through, at instruction
+// number at or, if at is negative, at the first instruction reached at virtual
+// time ms.  The picture at that point is drawn first, without any delays, and
+// the display's virtual clock is moved on to that time.  The seek starts from
+// the nearest keyframe in the index before the target, and adds any keyframes
+// it passes beyond the end of the index, unless the index is NULL.
+bool vm_seek(sketch_vm *vm, const unsigned char *p, const unsigned char *end,
+             long at, long ms, keyframes *index);